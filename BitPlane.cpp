@@ -0,0 +1,173 @@
+// bit-packed mask planes.
+// the row operations work on whole words, so a 64-pixel run costs one instruction.
+#include "astralcat.h"
+#include <stdexcept>
+#include <boost/format.hpp>
+
+
+using namespace sli;
+using namespace astralcat;
+
+
+namespace {
+
+    // the row shifted one pixel to the right (bit x receives pixel x - 1) and to the left
+    inline uint64_t from_left(const uint64_t *row, int i, uint64_t edge) {
+        return row[i] << 1 | (i > 0 ? row[i - 1] >> 63 : edge);
+    }
+
+    inline uint64_t from_right(const uint64_t *row, int i, int words, uint64_t edge) {
+        return row[i] >> 1 | (i + 1 < words ? row[i + 1] << 63 : edge << 63);
+    }
+
+}
+
+
+namespace astralcat {
+
+    BitPlane::BitPlane(int width, int height) :
+        w(width), h(height), stride((width + 63) / 64), bits((size_t)stride * height, 0)
+    {
+    }
+
+
+    void BitPlane::clear_padding() {
+        if (w % 64 == 0)
+            return;
+        const uint64_t keep = (uint64_t(1) << (w % 64)) - 1;
+        for (int y = 0;  y < h;  y++)
+            row(y)[stride - 1] &= keep;
+    }
+
+
+    BitPlane &BitPlane::operator|=(const BitPlane &other) {
+        assert(w == other.w && h == other.h);
+        for (size_t i = 0;  i < bits.size();  i++)
+            bits[i] |= other.bits[i];
+        return *this;
+    }
+
+
+    BitPlane &BitPlane::operator&=(const BitPlane &other) {
+        assert(w == other.w && h == other.h);
+        for (size_t i = 0;  i < bits.size();  i++)
+            bits[i] &= other.bits[i];
+        return *this;
+    }
+
+
+    BitPlane &BitPlane::and_not(const BitPlane &other) {
+        assert(w == other.w && h == other.h);
+        for (size_t i = 0;  i < bits.size();  i++)
+            bits[i] &= ~other.bits[i];
+        return *this;
+    }
+
+
+    // r passes of the 3x3 square, each a horizontal then a vertical OR of shifted words
+    BitPlane BitPlane::dilate(int r) const {
+        BitPlane src = *this, tmp(w, h);
+        for (int k = 0;  k < r;  k++) {
+            #pragma omp parallel for
+            for (int y = 0;  y < h;  y++) {
+                const uint64_t *s = src.row(y);
+                uint64_t *d = tmp.row(y);
+                for (int i = 0;  i < stride;  i++)
+                    d[i] = s[i] | from_left(s, i, 0) | from_right(s, i, stride, 0);
+            }
+            #pragma omp parallel for
+            for (int y = 0;  y < h;  y++) {
+                const uint64_t *up   = tmp.row(std::max(0, y - 1)),
+                               *mid  = tmp.row(y),
+                               *down = tmp.row(std::min(h - 1, y + 1));
+                uint64_t *d = src.row(y);
+                for (int i = 0;  i < stride;  i++)
+                    d[i] = up[i] | mid[i] | down[i];
+            }
+            src.clear_padding();
+        }
+        return src;
+    }
+
+
+    BitPlane BitPlane::erode(int r) const {
+        BitPlane src = *this, tmp(w, h);
+        // the padding bits count as set while eroding, as does everything outside
+        const uint64_t pad = w % 64 == 0 ? 0 : ~((uint64_t(1) << (w % 64)) - 1);
+        for (int k = 0;  k < r;  k++) {
+            #pragma omp parallel for
+            for (int y = 0;  y < h;  y++) {
+                uint64_t *s = src.row(y);
+                s[stride - 1] |= pad;
+                uint64_t *d = tmp.row(y);
+                for (int i = 0;  i < stride;  i++)
+                    d[i] = s[i] & from_left(s, i, 1) & from_right(s, i, stride, 1);
+            }
+            #pragma omp parallel for
+            for (int y = 0;  y < h;  y++) {
+                const uint64_t *up   = tmp.row(std::max(0, y - 1)),
+                               *mid  = tmp.row(y),
+                               *down = tmp.row(std::min(h - 1, y + 1));
+                uint64_t *d = src.row(y);
+                for (int i = 0;  i < stride;  i++)
+                    d[i] = up[i] & mid[i] & down[i];
+            }
+            src.clear_padding();
+        }
+        return src;
+    }
+
+
+    long BitPlane::count() const {
+        long n = 0;
+        #pragma omp parallel for reduction(+:n)
+        for (long i = 0;  i < (long)bits.size();  i++)
+            n += __builtin_popcountll(bits[i]);
+        return n;
+    }
+
+
+    BitPlane BitPlane::from_mask(const mdarray_uchar &mask, unsigned char flag) {
+        BitPlane plane(mask.length(0), mask.length(1));
+        #pragma omp parallel for
+        for (int y = 0;  y < plane.h;  y++) {
+            const unsigned char *src = mask.array_ptr(0, y);
+            uint64_t *dst = plane.row(y);
+            for (int x = 0;  x < plane.w;  x++)
+                dst[x >> 6] |= uint64_t((src[x] & flag) != 0) << (x & 63);
+        }
+        return plane;
+    }
+
+
+    void BitPlane::to_mask(mdarray_uchar &mask, unsigned char flag) const {
+        if (mask.length(0) != w || mask.length(1) != h)
+            throw std::invalid_argument((boost::format("mask size mismatch: %dx%d != %dx%d") % mask.length(0) % mask.length(1) % w % h).str());
+        #pragma omp parallel for
+        for (int y = 0;  y < h;  y++) {
+            const uint64_t *src = row(y);
+            unsigned char *dst = mask.array_ptr(0, y);
+            for (int x = 0;  x < w;  x++) {
+                if (test(src, x))
+                    dst[x] |= flag;
+                else
+                    dst[x] &= ~flag;
+            }
+        }
+    }
+
+
+    void BitPlane::fill(mdarray_float &data, double value) const {
+        #pragma omp parallel for
+        for (int y = 0;  y < h;  y++) {
+            const uint64_t *src = row(y);
+            float *dst = data.array_ptr(0, y);
+            for (int i = 0;  i < stride;  i++) {
+                // visit the set bits only
+                for (uint64_t b = src[i];  b;  b &= b - 1)
+                    dst[i * 64 + __builtin_ctzll(b)] = value;
+            }
+        }
+    }
+
+}
@@ -0,0 +1,364 @@
+// row streaming access to simple image HDUs.
+// fitscc always holds the whole file in memory, which is what we want to avoid for
+// mosaics much larger than RAM.  Only the subset of FITS that our own tools write is
+// supported: image HDUs with BITPIX 8/16/32/64/-32/-64 and BZERO/BSCALE.
+#include "astralcat.h"
+#include <string.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <stdexcept>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <boost/format.hpp>
+
+
+using namespace sli;
+using namespace astralcat;
+using std::string;
+
+
+namespace {
+
+    const int block_size = 2880,
+              card_size  = 80;
+
+
+    string card_value(const char *card) {
+        // KEYWORD = value / comment
+        if (strncmp(card + 8, "= ", 2) != 0)
+            return "";
+        string v(card + 10, card_size - 10);
+        if (v.find('\'') != string::npos) {
+            auto b = v.find('\''),
+                 e = v.find('\'', b + 1);
+            v = v.substr(b + 1, e == string::npos ? string::npos : e - b - 1);
+        }
+        else {
+            v = v.substr(0, v.find('/'));
+        }
+        while (! v.empty() && v[v.size() - 1] == ' ')
+            v.erase(v.size() - 1);
+        while (! v.empty() && v[0] == ' ')
+            v.erase(0, 1);
+        return v;
+    }
+
+
+    string card_key(const char *card) {
+        string k(card, 8);
+        return k.substr(0, k.find(' '));
+    }
+
+
+    // the cards of the next header; false if the file ends before it starts
+    bool read_cards(digeststreamio &in, const string &filename, std::map<string, string> &cards) {
+        cards.clear();
+        char block[block_size];
+        for (bool first = true;  ;  first = false) {
+            const long n = in.read(block, block_size);
+            if (first && n == 0)
+                return false;
+            if (n != block_size)
+                throw std::runtime_error((boost::format("unexpected end of header: %s") % filename).str());
+            for (int i = 0;  i < block_size / card_size;  i++) {
+                const char *card = block + i * card_size;
+                string key = card_key(card);
+                if (key == "END")
+                    return true;
+                cards.insert({key, card_value(card)});
+            }
+        }
+    }
+
+
+    // the size of the data unit following a header, padded to whole blocks
+    long data_bytes(const std::map<string, string> &cards) {
+        long n = atoi(cards.at("NAXIS").c_str()) > 0 ? 1 : 0;
+        for (int i = 1;  i <= atoi(cards.at("NAXIS").c_str());  i++)
+            n *= atol(cards.at((boost::format("NAXIS%d") % i).str()).c_str());
+        n *= std::abs(atoi(cards.at("BITPIX").c_str())) / 8;
+        if (cards.count("PCOUNT"))
+            n += atol(cards.at("PCOUNT").c_str());
+        return (n + block_size - 1) / block_size * block_size;
+    }
+
+
+    template <typename T, typename U>
+    void decode(const char *buf, float *dst, int n, double bzero, double bscale, U (*to_host)(U)) {
+        for (int i = 0;  i < n;  i++) {
+            U u;
+            memcpy(&u, buf + i * sizeof(U), sizeof(U));
+            u = to_host(u);
+            T t;
+            memcpy(&t, &u, sizeof(T));
+            dst[i] = bzero + bscale * t;
+        }
+    }
+
+    uint8_t  be8toh_(uint8_t x)   { return x; }
+    uint16_t be16toh_(uint16_t x) { return be16toh(x); }
+    uint32_t be32toh_(uint32_t x) { return be32toh(x); }
+    uint64_t be64toh_(uint64_t x) { return be64toh(x); }
+
+}
+
+
+struct astralcat::FitsRowReader::Impl {
+    string filename;
+    long hdu_index;
+    digeststreamio in;
+    std::map<string, string> cards;
+    int width, height, bitpix;
+    double bzero, bscale;
+    int next_row;
+    std::vector<char> buf;
+    // rows [kept_y0, next_row) of the last read, so that an overlapping read does not go back in the file
+    mdarray_float kept;
+    int kept_y0;
+
+
+    Impl(const char *filename, long hdu_index) : filename(filename), hdu_index(hdu_index) {
+        rewind();
+    }
+
+
+    ~Impl() {
+        in.close();
+    }
+
+
+    void read_header() {
+        if (! read_cards(in, filename, cards))
+            throw std::runtime_error((boost::format("unexpected end of file: %s") % filename).str());
+    }
+
+
+    void rewind() {
+        in.close();
+        if (in.open("r", filename.c_str()) < 0)
+            throw std::runtime_error((boost::format("failed to open %s") % filename).str());
+        for (long i = 0;  i <= hdu_index;  i++) {
+            read_header();
+            if (i < hdu_index)
+                skip(data_bytes(cards));
+        }
+        if (atoi(cards["NAXIS"].c_str()) != 2)
+            throw std::runtime_error((boost::format("not a 2d image: %s[%d]") % filename % hdu_index).str());
+        width  = atoi(cards["NAXIS1"].c_str());
+        height = atoi(cards["NAXIS2"].c_str());
+        bitpix = atoi(cards["BITPIX"].c_str());
+        bzero  = cards.count("BZERO")  ? atof(cards["BZERO"].c_str())  : 0.;
+        bscale = cards.count("BSCALE") ? atof(cards["BSCALE"].c_str()) : 1.;
+        buf.resize((size_t)width * std::abs(bitpix) / 8);
+        next_row = 0;
+        kept = mdarray_float();
+        kept_y0 = 0;
+    }
+
+
+    void skip(long bytes) {
+        if (bytes > 0 && in.rskip(bytes) != bytes)
+            throw std::runtime_error((boost::format("unexpected end of data: %s") % filename).str());
+    }
+
+
+    double header(const char *key, double default_value) const {
+        auto it = cards.find(key);
+        return it == cards.end() ? default_value : atof(it->second.c_str());
+    }
+
+
+    mdarray_float read(int y0, int rows) {
+        assert(y0 >= 0 && y0 + rows <= height);
+        mdarray_float data(false, width, rows);
+        int y = y0;
+        if (y0 < next_row && y0 >= kept_y0) {
+            const int n = std::min(next_row, y0 + rows) - y0;
+            const float *src = kept.array_ptr(0, y0 - kept_y0);
+            std::copy(src, src + (size_t)n * width, data.array_ptr(0, 0));
+            y += n;
+        }
+        else if (y0 < next_row) {
+            rewind();
+        }
+        if (y == y0 + rows)
+            return data;
+
+        skip((long)(y - next_row) * buf.size());
+        for (;  y < y0 + rows;  y++) {
+            if (in.read(&buf[0], buf.size()) != buf.size())
+                throw std::runtime_error((boost::format("unexpected end of data: %s") % filename).str());
+            float *dst = data.array_ptr(0, y - y0);
+            switch (bitpix) {
+                case   8:  decode<uint8_t>(&buf[0], dst, width, bzero, bscale, be8toh_);  break;
+                case  16:  decode<int16_t>(&buf[0], dst, width, bzero, bscale, be16toh_); break;
+                case  32:  decode<int32_t>(&buf[0], dst, width, bzero, bscale, be32toh_); break;
+                case  64:  decode<int64_t>(&buf[0], dst, width, bzero, bscale, be64toh_); break;
+                case -32:  decode<float>  (&buf[0], dst, width, bzero, bscale, be32toh_); break;
+                case -64:  decode<double> (&buf[0], dst, width, bzero, bscale, be64toh_); break;
+                default:
+                    throw std::runtime_error((boost::format("unsupported BITPIX=%d: %s") % bitpix % filename).str());
+            }
+        }
+        next_row = y0 + rows;
+        kept = data;
+        kept_y0 = y0;
+        return data;
+    }
+
+
+    void keep_from(int y) {
+        if (y >= next_row) {
+            kept = mdarray_float();
+            kept_y0 = next_row;
+        }
+        else if (y > kept_y0) {
+            mdarray_float tail;
+            tail = kept.section(0, width, y - kept_y0, next_row - y);
+            kept = tail;
+            kept_y0 = y;
+        }
+    }
+};
+
+
+struct astralcat::FitsRowWriter::Impl {
+    string filename;
+    digeststreamio out;
+    int width, height, written_rows;
+    long written_bytes;
+    std::vector<uint32_t> buf;
+
+
+    Impl(const char *filename, int width, int height, const char *extname, bool extension) :
+        filename(filename), width(width), height(height), written_rows(0), written_bytes(0), buf(width)
+    {
+        if (out.open("w", filename) < 0)
+            throw std::runtime_error((boost::format("failed to open %s") % filename).str());
+        std::vector<string> cards = {
+            extension ? "XTENSION= 'IMAGE   '" : "SIMPLE  =                    T",
+            "BITPIX  =                  -32",
+            "NAXIS   =                    2",
+            (boost::format("NAXIS1  = %20d") % width).str(),
+            (boost::format("NAXIS2  = %20d") % height).str(),
+            extension ? "PCOUNT  =                    0" : "EXTEND  =                    T",
+            extension ? "GCOUNT  =                    1" : "",
+            (boost::format("EXTNAME = '%-8s'") % extname).str(),
+            "END"
+        };
+        cards.erase(std::remove(cards.begin(), cards.end(), ""), cards.end());
+        string header;
+        for (const auto &c: cards) {
+            header += c;
+            header.append(card_size - c.size(), ' ');
+        }
+        header.append((block_size - header.size() % block_size) % block_size, ' ');
+        put(header.data(), header.size());
+        written_bytes = 0;
+    }
+
+
+    ~Impl() {
+        close();
+    }
+
+
+    void put(const void *p, long n) {
+        if (out.write(p, n) != n)
+            throw std::runtime_error((boost::format("failed to write %s") % filename).str());
+        written_bytes += n;
+    }
+
+
+    void write(const mdarray_float &rows) {
+        assert(rows.length(0) == width);
+        for (int y = 0;  y < rows.length(1);  y++) {
+            const float *src = rows.array_ptr(0, y);
+            for (int x = 0;  x < width;  x++) {
+                uint32_t u;
+                memcpy(&u, src + x, sizeof(u));
+                buf[x] = htobe32(u);
+            }
+            put(&buf[0], buf.size() * sizeof(uint32_t));
+            written_rows++;
+        }
+    }
+
+
+    void close() {
+        if (filename.empty())
+            return;
+        if (written_rows != height)
+            logger.warn("%s: %d of %d rows written", filename, written_rows, height);
+        std::vector<char> padding((block_size - written_bytes % block_size) % block_size, 0);
+        if (! padding.empty())
+            put(&padding[0], padding.size());
+        out.close();
+        filename.clear();
+    }
+};
+
+
+namespace astralcat {
+
+    FitsRowReader::FitsRowReader(const char *filename, long hdu_index) :
+        pimpl(new FitsRowReader::Impl(filename, hdu_index))
+    {
+    }
+
+    int FitsRowReader::width() const {
+        return pimpl->width;
+    }
+
+    int FitsRowReader::height() const {
+        return pimpl->height;
+    }
+
+    double FitsRowReader::header(const char *key, double default_value) const {
+        return pimpl->header(key, default_value);
+    }
+
+    mdarray_float FitsRowReader::read(int y0, int rows) {
+        return pimpl->read(y0, rows);
+    }
+
+    void FitsRowReader::keep_from(int y) {
+        pimpl->keep_from(y);
+    }
+
+
+    FitsRowWriter::FitsRowWriter(const char *filename, int width, int height, const char *extname, bool extension) :
+        pimpl(new FitsRowWriter::Impl(filename, width, height, extname, extension))
+    {
+    }
+
+    void FitsRowWriter::write(const mdarray_float &rows) {
+        pimpl->write(rows);
+    }
+
+    void FitsRowWriter::close() {
+        pimpl->close();
+    }
+
+
+    std::vector<string> fits_image_extnames(const char *filename) {
+        digeststreamio in;
+        if (in.open("r", filename) < 0)
+            throw std::runtime_error((boost::format("failed to open %s") % filename).str());
+        std::vector<string> names;
+        std::map<string, string> cards;
+        while (read_cards(in, filename, cards)) {
+            if (! names.empty() && ! (cards.count("XTENSION") && cards["XTENSION"] == "IMAGE"))
+                break;
+            names.push_back(cards.count("EXTNAME") ? cards["EXTNAME"] : "");
+            const long bytes = data_bytes(cards);
+            if (bytes > 0 && in.rskip(bytes) != bytes)
+                throw std::runtime_error((boost::format("unexpected end of data: %s") % filename).str());
+        }
+        in.close();
+        return names;
+    }
+
+}
+
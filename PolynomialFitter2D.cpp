@@ -5,6 +5,9 @@
 #include <boost/numeric/ublas/lu.hpp>
 #include <boost/numeric/ublas/io.hpp>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <boost/progress.hpp>
 #include <sli/mdarray_statistics.h>
 #include "Coeff2D.h"
 
@@ -105,6 +108,241 @@ namespace {
         }
     };
 
+    // in-place cholesky factor (lower) of the symmetric m x m matrix; false if not positive definite
+    bool cholesky(std::vector<double> &A, int m) {
+        for (int j = 0;  j < m;  j++) {
+            double d = A[j * m + j];
+            for (int k = 0;  k < j;  k++)
+                d -= A[j * m + k] * A[j * m + k];
+            if (! (d > 1.e-14 * A[j * m + j]))
+                return false;
+            d = sqrt(d);
+            A[j * m + j] = d;
+            for (int i = j + 1;  i < m;  i++) {
+                double s = A[i * m + j];
+                for (int k = 0;  k < j;  k++)
+                    s -= A[i * m + k] * A[j * m + k];
+                A[i * m + j] = s / d;
+            }
+        }
+        return true;
+    }
+
+
+    void cholesky_solve(const std::vector<double> &L, int m, double *b) {
+        for (int i = 0;  i < m;  i++) {
+            for (int k = 0;  k < i;  k++)
+                b[i] -= L[i * m + k] * b[k];
+            b[i] /= L[i * m + i];
+        }
+        for (int i = m - 1;  i >= 0;  i--) {
+            for (int k = i + 1;  k < m;  k++)
+                b[i] -= L[k * m + i] * b[k];
+            b[i] /= L[i * m + i];
+        }
+    }
+
+
+    /*
+     * the least squares of a polynomial on a fixed cell geometry.
+     * X (m terms x N pixels) and the normal matrix G = X X^T of the full cell are the
+     * same for every cell, so G is factorised and inverted once.  Full cells are then
+     * C = G^-1 X Z, for a whole row of them at a time.  A cell missing the pixels M
+     * solves G - X_M X_M^T: by Woodbury on G^-1 when |M| < m, otherwise by Cholesky of
+     * the rank |M| downdate of G, or of the sum over its valid pixels when that is fewer.
+     * Coordinates are scaled to [-1, 1] for the conditioning.
+     */
+    class CellFitter {
+        const int n, m, width, height, N;
+        std::vector<double> X, G, G_inv;
+    public:
+        CellFitter(int n, int width, int height) : n(n), m(n * (n + 1) / 2), width(width), height(height), N(width * height), X((size_t)m * N), G(m * m), G_inv(m * m) {
+            const double cx = 0.5 * (width - 1),
+                         cy = 0.5 * (height - 1),
+                         sx = std::max(cx, 1.),
+                         sy = std::max(cy, 1.);
+            for (int i = 0;  i < N;  i++) {
+                const double u = (i % width - cx) / sx,
+                             v = (i / width - cy) / sy;
+                int k = 0;
+                double up = 1.;
+                for (int p = 0;  p < n;  p++) {
+                    double vq = 1.;
+                    for (int q = 0;  q < n - p;  q++) {
+                        X[(size_t)k * N + i] = up * vq;
+                        k++;
+                        vq *= v;
+                    }
+                    up *= u;
+                }
+            }
+            for (int k = 0;  k < m;  k++) {
+                for (int l = 0;  l <= k;  l++) {
+                    double s = 0.;
+                    for (int i = 0;  i < N;  i++)
+                        s += X[(size_t)k * N + i] * X[(size_t)l * N + i];
+                    G[k * m + l] = G[l * m + k] = s;
+                }
+            }
+            std::vector<double> L = G;
+            if (! cholesky(L, m))
+                throw std::invalid_argument("cell too small for the fitting order");
+            for (int j = 0;  j < m;  j++) {
+                std::vector<double> e(m, 0.);
+                e[j] = 1.;
+                cholesky_solve(L, m, &e[0]);
+                for (int i = 0;  i < m;  i++)
+                    G_inv[i * m + j] = e[i];
+            }
+        }
+
+        int pixels() const { return N; }
+
+        /*
+         * fit() of the cells with no missing pixels, cells[j] being the j-th N pixels of z,
+         * m coefficients of c and N of s: B = X Z, C = G^-1 B and S = X^T C, each product
+         * going through a row of X once for all the cells.
+         */
+        void fit_full(const std::vector<int> &cells, const float *z, double *c, double *s) const {
+            const int nc = cells.size();
+            if (nc == 0)
+                return;
+            std::vector<double> B((size_t)m * nc);
+            for (int k = 0;  k < m;  k++) {
+                const double *x = &X[(size_t)k * N];
+                for (int j = 0;  j < nc;  j++) {
+                    const float *zj = z + (size_t)cells[j] * N;
+                    double sum = 0.;
+                    for (int i = 0;  i < N;  i++)
+                        sum += x[i] * zj[i];
+                    B[(size_t)k * nc + j] = sum;
+                }
+            }
+            for (int j = 0;  j < nc;  j++) {
+                double *cj = c + (size_t)cells[j] * m;
+                for (int k = 0;  k < m;  k++) {
+                    double sum = 0.;
+                    for (int l = 0;  l < m;  l++)
+                        sum += G_inv[k * m + l] * B[(size_t)l * nc + j];
+                    cj[k] = sum;
+                }
+                std::fill(s + (size_t)cells[j] * N, s + (size_t)(cells[j] + 1) * N, 0.);
+            }
+            for (int k = 0;  k < m;  k++) {
+                const double *x = &X[(size_t)k * N];
+                for (int j = 0;  j < nc;  j++) {
+                    const double ck = c[(size_t)cells[j] * m + k];
+                    double *sj = s + (size_t)cells[j] * N;
+                    for (int i = 0;  i < N;  i++)
+                        sj[i] += ck * x[i];
+                }
+            }
+        }
+
+        // fits z (NaN skipped) into the coefficients c and the surface s; false if the valid pixels do not determine the polynomial
+        bool fit(const float *z, double *c, double *s) const {
+            std::vector<double> b(m, 0.);
+            std::vector<int> missing;
+            for (int i = 0;  i < N;  i++) {
+                if (! isfinite(z[i]))
+                    missing.push_back(i);
+            }
+            if (N - (int)missing.size() < m)
+                return false;
+            for (int k = 0;  k < m;  k++) {
+                const double *x = &X[(size_t)k * N];
+                double sum = 0.;
+                for (int i = 0;  i < N;  i++)
+                    sum += isfinite(z[i]) ? x[i] * z[i] : 0.;
+                b[k] = sum;
+            }
+
+            // g = G^-1 b, the solution if nothing is missing
+            std::vector<double> g(m);
+            for (int k = 0;  k < m;  k++) {
+                double sum = 0.;
+                for (int l = 0;  l < m;  l++)
+                    sum += G_inv[k * m + l] * b[l];
+                g[k] = sum;
+            }
+
+            if (missing.empty()) {
+                std::copy(g.begin(), g.end(), c);
+            }
+            else if (missing.size() < m) {
+                // (G - U U^T)^-1 b = g + W (I - U^T W)^-1 U^T g, with U = X_M and W = G^-1 U
+                const int nm = missing.size();
+                std::vector<double> W((size_t)m * nm), K(nm * nm), t(nm);
+                for (int k = 0;  k < m;  k++) {
+                    for (int j = 0;  j < nm;  j++) {
+                        double sum = 0.;
+                        for (int l = 0;  l < m;  l++)
+                            sum += G_inv[k * m + l] * X[(size_t)l * N + missing[j]];
+                        W[k * nm + j] = sum;
+                    }
+                }
+                for (int i = 0;  i < nm;  i++) {
+                    double sum = 0.;
+                    for (int k = 0;  k < m;  k++)
+                        sum += X[(size_t)k * N + missing[i]] * g[k];
+                    t[i] = sum;
+                    for (int j = 0;  j <= i;  j++) {
+                        double sum = 0.;
+                        for (int k = 0;  k < m;  k++)
+                            sum += X[(size_t)k * N + missing[i]] * W[k * nm + j];
+                        K[i * nm + j] = K[j * nm + i] = (i == j) - sum;
+                    }
+                }
+                // K is positive definite exactly when the downdated G is
+                if (! cholesky(K, nm))
+                    return false;
+                cholesky_solve(K, nm, &t[0]);
+                for (int k = 0;  k < m;  k++) {
+                    double sum = g[k];
+                    for (int j = 0;  j < nm;  j++)
+                        sum += W[k * nm + j] * t[j];
+                    c[k] = sum;
+                }
+            }
+            else {
+                std::vector<double> A(m * m);
+                const bool downdate = 2 * missing.size() <= N;
+                if (downdate)
+                    A = G;
+                for (int k = 0;  k < m;  k++) {
+                    const double *xk = &X[(size_t)k * N];
+                    for (int l = 0;  l <= k;  l++) {
+                        const double *xl = &X[(size_t)l * N];
+                        double sum = 0.;
+                        if (downdate) {
+                            for (int i: missing)
+                                sum -= xk[i] * xl[i];
+                        }
+                        else {
+                            for (int i = 0;  i < N;  i++)
+                                sum += isfinite(z[i]) ? xk[i] * xl[i] : 0.;
+                        }
+                        A[k * m + l] += sum;
+                        A[l * m + k] = A[k * m + l];
+                    }
+                }
+                if (! cholesky(A, m))
+                    return false;
+                std::copy(b.begin(), b.end(), c);
+                cholesky_solve(A, m, c);
+            }
+
+            for (int i = 0;  i < N;  i++)
+                s[i] = 0.;
+            for (int k = 0;  k < m;  k++) {
+                const double *x = &X[(size_t)k * N];
+                for (int i = 0;  i < N;  i++)
+                    s[i] += c[k] * x[i];
+            }
+            return true;
+        }
+    };
+
 } // namespace
 
 
@@ -143,4 +381,128 @@ namespace astralcat {
         return fitter;
     }
 
+    PolynomialFitter2D::Grid
+    PolynomialFitter2D::grid_fit_cells(const mdarray_float &src, int cellsize, int order, double clipping_sigma, int repeat) {
+        const int width  = src.length(0),
+                  height = src.length(1),
+                  gnx = (width  + cellsize - 1) / cellsize,
+                  gny = (height + cellsize - 1) / cellsize,
+                  m = order * (order + 1) / 2;
+
+        const CellFitter fitter(order, cellsize, cellsize);
+        const int N = fitter.pixels();
+
+        Grid grid = {width, height, cellsize, order, std::vector<double>((size_t)gnx * gny * m)};
+
+        boost::progress_display progress(gny, std::cerr);
+        #pragma omp parallel
+        {
+            std::vector<float> z((size_t)gnx * N);
+            std::vector<double> s((size_t)gnx * N);
+            #pragma omp for schedule(dynamic)
+            for (int gy = 0;  gy < gny;  gy++) {
+                // the row of cells; the part outside the frame counts as missing, as iterative_fit of a clipped section
+                for (int gx = 0;  gx < gnx;  gx++) {
+                    for (int y = 0;  y < cellsize;  y++) {
+                        for (int x = 0;  x < cellsize;  x++) {
+                            const int sx = gx * cellsize + x,
+                                      sy = gy * cellsize + y;
+                            z[(size_t)gx * N + y * cellsize + x] = sx < width && sy < height ? src(sx, sy) : NAN;
+                        }
+                    }
+                }
+                double *c = &grid.coeff[(size_t)gy * gnx * m];
+
+                // the cells still being fitted; those with no pixel missing go through fit_full together
+                std::vector<int> active(gnx);
+                for (int gx = 0;  gx < gnx;  gx++)
+                    active[gx] = gx;
+                for (int times = 0;  times <= repeat && ! active.empty();  times++) {
+                    std::vector<int> full, fitted;
+                    for (int gx: active) {
+                        const float *zc = &z[(size_t)gx * N];
+                        if (std::all_of(zc, zc + N, [](float v) { return isfinite(v); }))
+                            full.push_back(gx);
+                        else if (fitter.fit(zc, c + (size_t)gx * m, &s[(size_t)gx * N]))
+                            fitted.push_back(gx);
+                        else
+                            std::fill(c + (size_t)gx * m, c + (size_t)(gx + 1) * m, NAN);
+                    }
+                    fitter.fit_full(full, &z[0], c, &s[0]);
+                    fitted.insert(fitted.end(), full.begin(), full.end());
+                    active.swap(fitted);
+
+                    if (times < repeat) {
+                        for (int gx: active) {
+                            float *zc = &z[(size_t)gx * N];
+                            const double *sc = &s[(size_t)gx * N];
+                            double sum = 0., sum2 = 0.;
+                            int count = 0;
+                            for (int i = 0;  i < N;  i++) {
+                                if (isfinite(zc[i])) {
+                                    const double d = zc[i] - sc[i];
+                                    sum += d;
+                                    sum2 += d * d;
+                                    count++;
+                                }
+                            }
+                            const double stddev = sqrt(std::max(0., (sum2 - sum * sum / count) / (count - 1)));
+                            for (int i = 0;  i < N;  i++) {
+                                if (fabs(zc[i] - sc[i]) > clipping_sigma * stddev)
+                                    zc[i] = NAN;
+                            }
+                        }
+                    }
+                }
+                #pragma omp critical
+                ++progress;
+            }
+        }
+        return grid;
+    }
+
+
+    /*
+     * the polynomials in CellFitter's basis: u and v are the cell coordinates scaled to
+     * [-1, 1], so a pixel costs one term per coefficient.
+     */
+    void PolynomialFitter2D::Grid::rows(int y0, int rows, float *out) const {
+        const int gnx = (width + cellsize - 1) / cellsize,
+                  m = order * (order + 1) / 2;
+        const double c0 = 0.5 * (cellsize - 1),
+                     scale = std::max(c0, 1.);
+        #pragma omp parallel for
+        for (int y = y0;  y < y0 + rows;  y++) {
+            const int gy = y / cellsize;
+            const double v = (y % cellsize - c0) / scale;
+            float *o = out + (size_t)(y - y0) * width;
+            for (int x = 0;  x < width;  x++) {
+                const double *c = &coeff[((size_t)gy * gnx + x / cellsize) * m],
+                             u = (x % cellsize - c0) / scale;
+                double sum = 0.,
+                       up = 1.;
+                int k = 0;
+                for (int p = 0;  p < order;  p++) {
+                    double vq = up;
+                    for (int q = 0;  q < order - p;  q++) {
+                        sum += c[k++] * vq;
+                        vq *= v;
+                    }
+                    up *= u;
+                }
+                o[x] = sum;
+            }
+        }
+    }
+
+
+    mdarray_float
+    PolynomialFitter2D::grid_fit(const mdarray_float &src, int cellsize, int order, double clipping_sigma, int repeat) {
+        const Grid grid = grid_fit_cells(src, cellsize, order, clipping_sigma, repeat);
+        mdarray_float surface(false, grid.width, grid.height);
+        if (grid.height > 0)
+            grid.rows(0, grid.height, surface.array_ptr(0, 0));
+        return surface;
+    }
+
 } // namespace astralcat
@@ -6,9 +6,9 @@
 #include <stdexcept>
 #include <boost/format.hpp>
 #include <sli/mdarray_statistics.h>
-#include <boost/numeric/ublas/exception.hpp>
 #include <initializer_list>
 #include <boost/progress.hpp>
+#include <algorithm>
 
 
 using namespace sli;
@@ -26,29 +26,22 @@ std::ostream& operator<<(std::ostream &os, const std::map<std::basic_string<char
 namespace {
 
 
-    double local_sky(mdarray_float section) try {
-        auto fitter = PolynomialFitter2D::iterative_fit(section, 3);
-        if ((double)valid_count(section) / section.length() < 0.25) {
-            return NAN;
-        }
-        return fitter->at(section.length(0) / 2., section.length(1) / 2.);
-    }
-    catch (const boost::numeric::ublas::singular &e) {
-        return NAN;
-    }
-    catch (const std::exception &e) {
-        logger.warn("failed to estimate local sky: %e", e.what());
-        return NAN;
+    void copy_rows(const mdarray_float &src, int y0, int rows, float *out) {
+        std::copy(src.array_ptr(0, y0), src.array_ptr(0, y0) + (size_t)rows * src.length(0), out);
     }
 
 
     class DoNothingEstimator: public SkyEstimator {
+        int width;
     public:
-        DoNothingEstimator(StrKeyValue args, const mdarray_float &surface) {}
+        DoNothingEstimator(StrKeyValue args, const mdarray_float &surface) : width(surface.length(0)) {}
         mdarray_float surface() const {
             mdarray_float zero;
             return zero;
         }
+        void surface_rows(int y0, int rows, float *out) const {
+            std::fill(out, out + (size_t)rows * width, 0.f);
+        }
     };
 
 
@@ -58,7 +51,8 @@ namespace {
     public:
         PolynomialEstimator(StrKeyValue args, const mdarray_float &src) {
             reverse_merge(args, {{"fitting_order", "7"},
-                                 {"binsize",       "50"}});
+                                 {"binsize",       "50"},
+                                 {"statistic",     "polynomial"}});
 
             logger.info("PolynomialEstimator: %s", boost::lexical_cast<string>(args));
 
@@ -72,13 +66,12 @@ namespace {
 
             fitter = PolynomialFitter2D::initialize(fitting_order);
 
+            const mdarray_float grid = mesh(src, binsize, mesh_statistic(args["statistic"].c_str()));
             for (int gy = 0;  gy < gny;  gy++) {
                 double y = (gy + 0.5) * binsize;
                 for (int gx = 0;  gx < gnx;  gx++) {
-                    mdarray_float section;
-                    section = src.section(gx * binsize, binsize, gy *binsize, binsize);
                     double x = (gx + 0.5) * binsize,
-                           z = local_sky(section);
+                           z = grid(gx, gy);
                     if (isfinite(z))
                         fitter->add(x, y, z);
                 }
@@ -89,16 +82,27 @@ namespace {
         mdarray_float surface() const {
             return fitter->surface(0, width, 0, height, width, height);
         }
+
+        void surface_rows(int y0, int rows, float *out) const {
+            #pragma omp parallel for
+            for (int y = y0;  y < y0 + rows;  y++) {
+                float *o = out + (size_t)(y - y0) * width;
+                for (int x = 0;  x < width;  x++)
+                    o[x] = fitter->at(x, y);
+            }
+        }
     };
 
 
     class GridEstimator : public SkyEstimator {
         SplineSurface::PTR spline;
+        SplineSurface::Evaluator::PTR sky;
         int width, height;
     public:
         GridEstimator(StrKeyValue args, const mdarray_float &src) {
             reverse_merge(args, {{"interpolation_method", "akima"},
-                                 {"binsize",              "50"}});
+                                 {"binsize",              "50"},
+                                 {"statistic",            "polynomial"}});
 
             logger.info("GridEstimator: %s", boost::lexical_cast<string>(args));
 
@@ -111,65 +115,256 @@ namespace {
 
             spline = SplineSurface::initialize(args["interpolation_method"].c_str());
 
+            const mdarray_float grid = mesh(src, binsize, mesh_statistic(args["statistic"].c_str()));
             for (int gy = 0;  gy < gny;  gy++) {
-                logger.debug("row: %d/%d", gy, gny);
                 double y = (gy + 0.5) * binsize;
                 spline->set_y(y);
                 for (int gx = 0;  gx < gnx;  gx++) {
-                    mdarray_float section;
-                    section = src.section(gx * binsize, binsize, gy *binsize, binsize);
-                    double x = (gx + 0.5) * binsize,
-                           z = local_sky(section);
-                    spline->add_xz(x, z);
+                    double x = (gx + 0.5) * binsize;
+                    spline->add_xz(x, grid(gx, gy));
                 }
             }
+            sky = spline->evaluator(0, width, 0, height, width, height);
         }
 
         mdarray_float surface() const {
-            mdarray_float sky = spline->surface(0, width, 0, height, width, height);
-            return sky;
+            mdarray_float surface(false, width, height);
+            if (height > 0)
+                sky->rows(0, height, surface.array_ptr(0, 0));
+            return surface;
+        }
+
+        void surface_rows(int y0, int rows, float *out) const {
+            sky->rows(y0, rows, out);
         }
     };
 
 
+    /*
+     * median of the (2r + 1)^2 window around every pixel, NaN and the outside skipped,
+     * after Perreault & Hebert (2007).  Values are quantised to `levels` bins of bin_width
+     * from lo.  Each column keeps the histogram of its 2r + 1 rows, moved down by one
+     * pixel in and one out per row, and the window histogram is moved along the row by
+     * one column histogram in and one out per pixel.  Histograms are two-tier (coarse
+     * buckets of 32 bins) and the window's fine bins are only brought up to date in the
+     * bucket holding the median, so the cost per pixel does not depend on r.
+     * The result is the centre of the median's bin; windows whose median falls in the
+     * first or last bin, where the values were clamped, are computed exactly.
+     */
+    mdarray_float sliding_median(const mdarray_float &src, int r, double lo, double bin_width, int levels) {
+        const int width = src.length(0),
+                  height = src.length(1),
+                  fine_bins = 32,
+                  buckets = levels / fine_bins,
+                  strip = 64,
+                  strips = (height + strip - 1) / strip;
+        mdarray_float dst(false, width, height);
+
+        auto bin = [&](float v) {
+            if (! isfinite(v))
+                return -1;
+            const double t = (v - lo) / bin_width;
+            return t < 0. ? 0 : t >= levels ? levels - 1 : (int)t;
+        };
+
+        boost::progress_display progress(strips, std::cerr);
+        #pragma omp parallel
+        {
+            // column histograms of the strip, and the window histogram
+            std::vector<uint16_t> col_fine((size_t)width * levels), col_coarse((size_t)width * buckets);
+            std::vector<int> fine(levels), coarse(buckets), synced(buckets);
+
+            auto move_row = [&](int y, int d) {
+                const float *row = src.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    const int b = bin(row[x]);
+                    if (b >= 0) {
+                        col_fine[(size_t)x * levels + b] += d;
+                        col_coarse[(size_t)x * buckets + b / fine_bins] += d;
+                    }
+                }
+            };
+            auto move_coarse = [&](int x, int d) {
+                const uint16_t *c = &col_coarse[(size_t)x * buckets];
+                for (int b = 0;  b < buckets;  b++)
+                    coarse[b] += d * c[b];
+            };
+            auto move_fine = [&](int x, int b, int d) {
+                const uint16_t *c = &col_fine[(size_t)x * levels + b * fine_bins];
+                int *f = &fine[b * fine_bins];
+                for (int i = 0;  i < fine_bins;  i++)
+                    f[i] += d * c[i];
+            };
+            // brings the fine bins of bucket b to the window at x
+            auto sync = [&](int b, int x) {
+                if (synced[b] < 0 || x - synced[b] > 2 * r) {
+                    std::fill(&fine[b * fine_bins], &fine[b * fine_bins] + fine_bins, 0);
+                    for (int xx = std::max(0, x - r);  xx <= std::min(width - 1, x + r);  xx++)
+                        move_fine(xx, b, +1);
+                }
+                else {
+                    for (int xx = synced[b] + 1;  xx <= x;  xx++) {
+                        if (xx + r < width)
+                            move_fine(xx + r, b, +1);
+                        if (xx - r - 1 >= 0)
+                            move_fine(xx - r - 1, b, -1);
+                    }
+                }
+                synced[b] = x;
+            };
+            // bin of the k-th smallest value in the window at x
+            auto select = [&](int k, int x) {
+                int b = 0, acc = 0;
+                while (acc + coarse[b] <= k)
+                    acc += coarse[b++];
+                sync(b, x);
+                int i = b * fine_bins;
+                while (acc + fine[i] <= k)
+                    acc += fine[i++];
+                return i;
+            };
+
+            #pragma omp for schedule(dynamic)
+            for (int s = 0;  s < strips;  s++) {
+                #pragma omp critical
+                ++progress;
+                const int y0 = s * strip,
+                          y1 = std::min(height, y0 + strip);
+                for (int y = std::max(0, y0 - r);  y < std::min(height, y0 + r);  y++)
+                    move_row(y, +1);
+                for (int y = y0;  y < y1;  y++) {
+                    if (y > y0 && y - r - 1 >= 0)
+                        move_row(y - r - 1, -1);
+                    if (y + r < height)
+                        move_row(y + r, +1);
+
+                    std::fill(coarse.begin(), coarse.end(), 0);
+                    std::fill(synced.begin(), synced.end(), -1);
+                    for (int x = 0;  x < std::min(width, r);  x++)
+                        move_coarse(x, +1);
+
+                    float *out = dst.array_ptr(0, y);
+                    for (int x = 0;  x < width;  x++) {
+                        if (x + r < width)
+                            move_coarse(x + r, +1);
+                        if (x - r - 1 >= 0)
+                            move_coarse(x - r - 1, -1);
+                        int n = 0;
+                        for (int b = 0;  b < buckets;  b++)
+                            n += coarse[b];
+                        if (n == 0) {
+                            out[x] = NAN;
+                            continue;
+                        }
+                        const int i = select((n - 1) / 2, x),
+                                  j = select(n / 2, x);
+                        if (i == 0 || j == levels - 1) {
+                            mdarray_float section;
+                            section = src.section(x - r, 2*r + 1, y - r, 2*r + 1);
+                            out[x] = md_median(section);
+                        }
+                        else {
+                            out[x] = lo + (0.5 * (i + j) + 0.5) * bin_width;
+                        }
+                    }
+                }
+                // leave the column histograms empty for the next strip
+                for (int y = std::max(0, y1 - 1 - r);  y < std::min(height, y1 + r);  y++)
+                    move_row(y, -1);
+            }
+        }
+        return dst;
+    }
+
+
+    /*
+     * the one estimator that keeps a full frame: a pixel's median needs the source
+     * around it, and subtract() overwrites that source band by band, so the rows could
+     * only be made on demand from a copy of the frame, which is as large.
+     */
     class MedianFilterEstimator : public SkyEstimator {
         mdarray_float sky;
         int width, height;
     public:
         MedianFilterEstimator(StrKeyValue args, const mdarray_float &src) {
-            reverse_merge(args, {{"cellsize", "15"}});
+            reverse_merge(args, {{"cellsize",  "15"},
+                                 {"method",    "histogram"},
+                                 {"levels",    "1024"},
+                                 {"tolerance", "auto"}});
 
             auto log_indent = logger.info("MedianFilterEstimator: %s", boost::lexical_cast<string>(args)).indent();
 
             width  = src.length(0);
             height = src.length(1);
 
-            sky = mdarray_float(false, width, height);
-
             const int cellsize = boost::lexical_cast<int>(args["cellsize"]);
 
-            boost::progress_display progress(height, std::cerr);
-            #pragma omp parallel
-            #pragma omp for
-            for (int y = 0;  y < height;  y++) {
-                ++progress;
-                for (int x = 0;  x < width;  x++) {
-                    mdarray_float section;
-                    section = src.section(x - cellsize, 2*cellsize + 1, y - cellsize, 2*cellsize + 1);
-                    sky(x, y) = md_median(section);
+            if (args["method"] == "histogram") {
+                const int levels = boost::lexical_cast<int>(args["levels"]);
+                if (levels < 64 || levels % 32 != 0 || 2*cellsize + 1 > 65535)
+                    throw std::invalid_argument((boost::format("invalid levels or cellsize: %s") % boost::lexical_cast<string>(args)).str());
+
+                // bins around the median of the frame, 2 * tolerance wide (default: sigma / 10)
+                std::vector<float> sample;
+                const int step = std::max(1, (int)(src.length() / 1000000));
+                for (int i = 0;  i < src.length();  i += step) {
+                    if (isfinite(src[i]))
+                        sample.push_back(src[i]);
+                }
+                if (sample.empty()) {
+                    sky = mdarray_float(false, width, height);
+                    sky = NAN;
+                    return;
                 }
+                std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+                const double median = sample[sample.size() / 2];
+                for (auto &v: sample)
+                    v = std::abs(v - median);
+                std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+                const double sigma = 1.4826 * sample[sample.size() / 2];
+
+                double bin_width = 2. * (args["tolerance"] == "auto" ? 0.05 * sigma : boost::lexical_cast<double>(args["tolerance"]));
+                if (! (bin_width > 0.))
+                    bin_width = 1.;
+                logger.info("bin width: %e", bin_width);
+
+                sky = sliding_median(src, cellsize, median - 0.5 * levels * bin_width, bin_width, levels);
+            }
+            else if (args["method"] == "exact") {
+                sky = mdarray_float(false, width, height);
+
+                boost::progress_display progress(height, std::cerr);
+                #pragma omp parallel
+                #pragma omp for
+                for (int y = 0;  y < height;  y++) {
+                    #pragma omp critical
+                    ++progress;
+                    for (int x = 0;  x < width;  x++) {
+                        mdarray_float section;
+                        section = src.section(x - cellsize, 2*cellsize + 1, y - cellsize, 2*cellsize + 1);
+                        sky(x, y) = md_median(section);
+                    }
+                }
+            }
+            else {
+                throw std::invalid_argument((boost::format("invalid method: %s") % args["method"]).str());
             }
         }
 
         mdarray_float surface() const {
             return sky;
         }
+
+        void surface_rows(int y0, int rows, float *out) const {
+            copy_rows(sky, y0, rows, out);
+        }
     };
 
 
+    // keeps the cells' coefficients and makes the rows of the sky as they are asked for
     class LocalPolyEstimator : public SkyEstimator {
         int width, height;
-        mdarray_float sky;
+        PolynomialFitter2D::Grid grid;
     public:
         LocalPolyEstimator(StrKeyValue args, const mdarray_float &src) {
             reverse_merge(args, {{"fitting_order",  "7"},
@@ -177,71 +372,85 @@ namespace {
                                  {"iteration",      "3"},
                                  {"binsize",       "50"}});
 
-            PolynomialFitter2D::PTR fitter;
-
             logger.info("LocalPolyEstimator: %s", boost::lexical_cast<string>(args));
 
             width  = src.length(0);
             height = src.length(1);
 
-            sky = mdarray_float(false, width, height);
-
             const int fitting_order = atoi(args["fitting_order"].c_str()),
                       iteration = atoi(args["iteration"].c_str()),
-                      binsize = atoi(args["binsize"].c_str()),
-                      gnx = src.length(0) / binsize + 1,
-                      gny = src.length(1) / binsize + 1;
+                      binsize = atoi(args["binsize"].c_str());
 
             const double clipping_sigma = atof(args["clipping_sigma"].c_str());
 
-            boost::progress_display progress(gny, std::cerr);
-            #pragma omp parallel
-            #pragma omp for
-            for (int gy = 0;  gy < gny;  gy++) {
-                for (int gx = 0;  gx < gnx;  gx++) {
-                    mdarray_float section;
-                    section = src.section(gx * binsize, binsize, gy *binsize, binsize);
-                    try {
-                        section = PolynomialFitter2D::iterative_fit(section, fitting_order, clipping_sigma, iteration)->surface(0, binsize, 0, binsize, binsize, binsize);
-                        if ((double)valid_count(section) / section.length() <= 0.75) {
-                            section = NAN;
-                        }
-                    }
-                    catch (const std::exception &e) {
-                        section = NAN;
-                    }
-                    sky.paste(section, gx * binsize, gy * binsize);
-                }
-                ++progress;
-            }
+            grid = PolynomialFitter2D::grid_fit_cells(src, binsize, fitting_order, clipping_sigma, iteration);
         }
 
         mdarray_float surface() const {
+            mdarray_float sky(false, width, height);
+            surface_rows(0, height, sky.array_ptr(0, 0));
             return sky;
         }
 
+        void surface_rows(int y0, int rows, float *out) const {
+            grid.rows(y0, rows, out);
+        }
+
     };
 
 
+    // the sum of estimators, each run on the data less the ones before it
     class Compound : public SkyEstimator {
-        std::vector<string> descriptors;
-        mdarray_float sky;
+        std::vector<SkyEstimator::PTR> estimators;
+        int width, height;
     public:
-        Compound(const mdarray_float &original, const std::vector<string> &descriptors) : descriptors(descriptors) {
+        Compound(const mdarray_float &original, const std::vector<string> &descriptors) : width(original.length(0)), height(original.length(1)) {
             mdarray_float subtracted = original;
             for (const auto &d: descriptors) {
                 auto se = SkyEstimator::initialize(d.c_str(), subtracted);
-                subtracted -= se->surface();
+                se->subtract(subtracted);
+                estimators.push_back(se);
             }
-            sky = original - subtracted;
         }
 
         mdarray_float surface() const {
+            mdarray_float sky(false, width, height);
+            surface_rows(0, height, sky.array_ptr(0, 0));
             return sky;
         }
+
+        void surface_rows(int y0, int rows, float *out) const {
+            const size_t n = (size_t)rows * width;
+            std::fill(out, out + n, 0.f);
+            std::vector<float> buf(n);
+            for (const auto &se: estimators) {
+                se->surface_rows(y0, rows, &buf[0]);
+                for (size_t i = 0;  i < n;  i++)
+                    out[i] += buf[i];
+            }
+        }
     };
 
 
+    // rows of the surface are made and applied this many at a time
+    const int band_height = 64;
+
+
+    void apply(const SkyEstimator &se, mdarray_float &data, float sign) {
+        const int width  = data.length(0),
+                  height = data.length(1);
+        std::vector<float> band((size_t)band_height * width);
+        for (int y0 = 0;  y0 < height;  y0 += band_height) {
+            const int rows = std::min(band_height, height - y0);
+            se.surface_rows(y0, rows, &band[0]);
+            float *z = data.array_ptr(0, y0);
+            #pragma omp parallel for
+            for (long i = 0;  i < (long)rows * width;  i++)
+                z[i] -= sign * band[i];
+        }
+    }
+
+
 }
 
 
@@ -268,4 +477,27 @@ namespace astralcat {
         }
     }
 
+
+    SkyEstimator::PTR SkyEstimator::initialize(const char *str, const mdarray_float &surface, const BitPlane &mask) {
+        // the estimators already skip NaN
+        mdarray_float masked = surface;
+        mask.fill(masked, NAN);
+        return initialize(str, masked);
+    }
+
+
+    void SkyEstimator::surface_rows(int y0, int rows, float *out) const {
+        copy_rows(surface(), y0, rows, out);
+    }
+
+
+    void SkyEstimator::subtract(mdarray_float &data) const {
+        apply(*this, data, 1.f);
+    }
+
+
+    void SkyEstimator::add(mdarray_float &data) const {
+        apply(*this, data, -1.f);
+    }
+
 }
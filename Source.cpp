@@ -9,7 +9,7 @@ using std::string;
 namespace astralcat {
 
     std::ostream &operator<<(std::ostream &os, const Source &s) {
-        return os << boost::format("% e % e % e ") % s[0] % s[1] % s.flux;
+        return os << boost::format("% e % e % e % e % e % e % e ") % s[0] % s[1] % s.flux % s.a % s.b % s.theta % s.ellipticity;
     }
 
     std::istream &operator>>(std::istream &is, Source &s) {
@@ -27,7 +27,8 @@ namespace astralcat {
         while (std::getline(is, line)) try {
             if (line[0] != '#') {
                 Source s;
-                if (sscanf(line.c_str(), "%le %le %le", &s[0], &s[1], &s.flux) == 3) {
+                // the shape columns are optional
+                if (sscanf(line.c_str(), "%le %le %le %le %le %le %le", &s[0], &s[1], &s.flux, &s.a, &s.b, &s.theta, &s.ellipticity) >= 3) {
                     sources.push_back(s);
                 }
                 else {
@@ -47,7 +48,7 @@ namespace astralcat {
             logger.warn("failed to open %s", fname);
             return;
         }
-        os << "# x y flux" << std::endl;
+        os << "# x y flux a b theta ellipticity" << std::endl;
         for (const auto &s: sources) {
             os << s << std::endl;
         }
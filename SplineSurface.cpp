@@ -3,6 +3,8 @@
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_spline.h>
 #include <map>
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <stdexcept>
 #include <boost/format.hpp>
@@ -16,19 +18,28 @@ using namespace astralcat;
 namespace {
 
 
+    // the cubic of [0, 1] through f(0), f(1/3), f(2/3) and f(1), as p[0] + p[1] t + p[2] t^2 + p[3] t^3
+    void cubic_through_thirds(double f0, double f1, double f2, double f3, double *p) {
+        p[0] = f0;
+        p[1] = 0.5 * (-11. * f0 + 18. * f1 -  9. * f2 + 2. * f3);
+        p[2] = 0.5 * ( 18. * f0 - 45. * f1 + 36. * f2 - 9. * f3);
+        p[3] = 0.5 * ( -9. * f0 + 27. * f1 - 27. * f2 + 9. * f3);
+    }
+
+
     class Interp : boost::noncopyable {
+        const gsl_interp_type *interp_type;
         gsl_interp *interp;
-        gsl_interp_accel *acc;
+        int allocated;
         double xmin, xmax;
         std::vector<double> xs, ys;
 
-    public:
-        typedef std::shared_ptr<Interp> PTR;
-        struct TooFewSamples {};
-
-        Interp(const gsl_interp_type *interp_type, const std::vector<double> &x_src, const std::vector<double> &y_src) {
+        // keeps the finite samples and initialises the interpolator on them
+        void load(const std::vector<double> &x_src, const std::vector<double> &y_src) {
             assert(x_src.size() == y_src.size());
 
+            xs.clear();
+            ys.clear();
             for (int i = 0;  i < x_src.size();  i++) {
                 if (isfinite(x_src[i]) && isfinite(y_src[i])) {
                     xs.push_back(x_src[i]);
@@ -40,25 +51,47 @@ namespace {
                 throw TooFewSamples();
             }
 
-            interp = gsl_interp_alloc(interp_type, xs.size());
-            acc = gsl_interp_accel_alloc();
+            if (xs.size() != allocated) {
+                if (interp)
+                    gsl_interp_free(interp);
+                interp = gsl_interp_alloc(interp_type, xs.size());
+                allocated = xs.size();
+            }
             gsl_interp_init(interp, &xs[0], &ys[0], xs.size());
             xmin = interp->xmin;
             xmax = interp->xmax;
         }
 
+    public:
+        typedef std::shared_ptr<Interp> PTR;
+        struct TooFewSamples {};
+
+        Interp(const gsl_interp_type *interp_type, const std::vector<double> &x_src, const std::vector<double> &y_src) : interp_type(interp_type), interp(NULL), allocated(0) {
+            load(x_src, y_src);
+        }
+
         ~Interp() {
-            gsl_interp_free(interp);
-            gsl_interp_accel_free(acc);
+            if (interp)
+                gsl_interp_free(interp);
+        }
+
+        // new samples, non-finite ones skipped as by the constructor; the interpolator is reused while their number stays
+        void update(const std::vector<double> &x_src, const std::vector<double> &y_src) {
+            load(x_src, y_src);
+        }
+
+        int size() const {
+            return xs.size();
         }
 
+        // no accelerator: the lookup is a bisection, and eval() is safe from any thread
         double extrapolation(double x, double x0) const {
             /*
              * f(d+x) ~ f(x) + d f'(x) + 1/2 d^2 f''(x) + ...
              */
-            double y0 = gsl_interp_eval(interp, &xs[0], &ys[0], x0, acc),
-                   a1 = gsl_interp_eval_deriv(interp, &xs[0], &ys[0], x0, acc),
-                   a2 = gsl_interp_eval_deriv2(interp, &xs[0], &ys[0], x0, acc),
+            double y0 = gsl_interp_eval(interp, &xs[0], &ys[0], x0, NULL),
+                   a1 = gsl_interp_eval_deriv(interp, &xs[0], &ys[0], x0, NULL),
+                   a2 = gsl_interp_eval_deriv2(interp, &xs[0], &ys[0], x0, NULL),
                     d = x - x0;
             return y0 + d*a1 + (1./2.)*d*d*a2;
         }
@@ -71,49 +104,90 @@ namespace {
                 return extrapolation(x, xmax);
             }
             else {
-                return gsl_interp_eval(interp, &xs[0], &ys[0], x, acc);
+                return gsl_interp_eval(interp, &xs[0], &ys[0], x, NULL);
             }
         }
 
-    };
-
+        /*
+         * the polynomial of every piece, 4 coefficients each, for every type but
+         * polynomial (a cubic or linear between samples):
+         * piece 0, left of the first sample, in d = x - xs[0] (the extrapolation),
+         * piece k (1..n-1) in t = (x - xs[k-1]) / (xs[k] - xs[k-1]),
+         * piece n, right of the last sample, in d = x - xs[n-1].
+         * the cubic of a piece is exact from its values at t = 0, 1/3, 2/3, 1.
+         */
+        void pieces(double *c) const {
+            const int n = xs.size();
+            for (int side = 0;  side < 2;  side++) {
+                const double x0 = side ? xmax : xmin;
+                double *p = c + 4 * (side ? n : 0);
+                p[0] = gsl_interp_eval(interp, &xs[0], &ys[0], x0, NULL);
+                p[1] = gsl_interp_eval_deriv(interp, &xs[0], &ys[0], x0, NULL);
+                p[2] = 0.5 * gsl_interp_eval_deriv2(interp, &xs[0], &ys[0], x0, NULL);
+                p[3] = 0.;
+            }
+            for (int k = 1;  k < n;  k++) {
+                const double h = xs[k] - xs[k-1],
+                             f0 = ys[k-1],
+                             f1 = gsl_interp_eval(interp, &xs[0], &ys[0], xs[k-1] + h / 3., NULL),
+                             f2 = gsl_interp_eval(interp, &xs[0], &ys[0], xs[k-1] + 2. * h / 3., NULL),
+                             f3 = ys[k];
+                cubic_through_thirds(f0, f1, f2, f3, c + 4 * k);
+            }
+        }
 
-    class SplineSurfaceImpl : public astralcat::SplineSurface {
-        struct Sample {
-            double x, y, z;
-        };
-        double y;
-        const gsl_interp_type *interp_type;
-        std::vector< std::vector<Sample> > sample;
-        int y_index;
+    };
 
-    public:
 
-        SplineSurfaceImpl(const gsl_interp_type *interp_type) : interp_type(interp_type)
-        {
-        }
+    struct Sample {
+        double x, y, z;
+    };
 
-        void set_y(double y) {
-            this->y = y;
-            sample.push_back({});
-            y_index = sample.size() - 1;
-        }
 
-        void add_xz(double x, double z) {
-            sample[y_index].push_back({x, y, z});
+    // the state of surface() that does not depend on the output rows, built once
+    class SurfaceEvaluator : public astralcat::SplineSurface::Evaluator {
+        const gsl_interp_type *interp_type;
+        double min_x, max_x, min_y, max_y;
+        int width, height;
+        std::vector<Interp::PTR> cols;
+        std::vector<double> col_x;
+        std::vector<const Interp *> valid_cols;
+        int n;
+        std::vector<int> piece;         // the piece of every output column
+        std::vector<double> local;      // and its coordinate in the piece
+        std::vector<double> knots;
+        int cells, stride;
+        std::vector<double> tensor;
+        std::vector<char> direct;
+
+        // the row interpolator at y, or NULL if too few columns are finite there
+        const Interp *row_at(double y, std::vector<double> &z, std::unique_ptr<Interp> &row_interp) const {
+            for (int j = 0;  j < n;  j++)
+                z[j] = valid_cols[j]->eval(y);
+            try {
+                if (row_interp)
+                    row_interp->update(col_x, z);
+                else
+                    row_interp.reset(new Interp(interp_type, col_x, z));
+            }
+            catch (const Interp::TooFewSamples &e) {
+                return NULL;
+            }
+            return row_interp.get();
         }
 
-        mdarray_float surface(double min_x, double max_x, double min_y, double max_y, int width, int height) const {
-            auto log_indent = logger.info("evaluating surface...").indent();
-            mdarray_float surface(false, width, height);
-
+    public:
+        SurfaceEvaluator(const gsl_interp_type *interp_type, const std::vector< std::vector<Sample> > &sample,
+                         double min_x, double max_x, double min_y, double max_y, int width, int height)
+            : interp_type(interp_type), min_x(min_x), max_x(max_x), min_y(min_y), max_y(max_y), width(width), height(height)
+        {
             const int grid_cols = sample[0].size(),
                       grid_rows = sample.size();
 
             logger.debug("making cols interpolators...");
-            std::vector<Interp::PTR> cols(sample[0].size());
+            cols.resize(grid_cols);
+            #pragma omp parallel for
             for (int j = 0;  j < grid_cols;  j++) {
-                logger.debug("%d/%d...", j, grid_cols);
                 std::vector<double> y(grid_rows), z(grid_rows);
                 for (int i = 0;  i < grid_rows;  i++) {
                     y[i] = sample[i][j].y;
@@ -127,29 +201,167 @@ namespace {
                 }
             }
 
-            logger.debug("making rows interpolators...");
-            for (int yi = 0;  yi < height;  yi++) {
-                double t = (double)yi / height,
-                       y = t*max_y + (1.-t)*min_y;
-                // make a row interpolator
-                std::vector<double> x, z;
-                for (int j = 0;  j < cols.size();  j++) {
-                    if (cols[j]) {
-                        x.push_back(sample[0][j].x);
-                        z.push_back(cols[j]->eval(y));
+            for (int j = 0;  j < cols.size();  j++) {
+                if (cols[j]) {
+                    col_x.push_back(sample[0][j].x);
+                    valid_cols.push_back(cols[j].get());
+                }
+            }
+            n = col_x.size();
+            if (n < interp_type->min_size)
+                throw Interp::TooFewSamples();
+
+            piece.resize(width);
+            local.resize(width);
+            for (int xi = 0;  xi < width;  xi++) {
+                double t = (double)xi / width,
+                       x = t*max_x + (1.-t)*min_x;
+                const int k = std::upper_bound(col_x.begin(), col_x.end(), x) - col_x.begin();
+                piece[xi] = k;
+                if (k == 0)
+                    local[xi] = x - col_x[0];
+                else if (k == n)
+                    local[xi] = x - col_x[n - 1];
+                else
+                    local[xi] = (x - col_x[k-1]) / (col_x[k] - col_x[k-1]);
+            }
+
+            /*
+             * the grid cells run between the x of the columns (the pieces, as in pieces())
+             * and between the y of the sample rows, widened to the output rows.  In a cell
+             * every column is a cubic in y, so for the types linear in the data (linear,
+             * cspline) the row pieces are cubics in y too: each cell's 4 x 4 tensor comes
+             * exactly from the row interpolators at 4 rows, and output rows only evaluate
+             * it.  akima weighs its slopes by their differences, which is not polynomial
+             * in y, so akima and polynomial, and cells whose rows lose a column to NaN,
+             * take the row interpolator at every output row.
+             */
+            knots.push_back(std::min(min_y, sample[0][0].y));
+            for (const auto &row: sample) {
+                if (row[0].y > knots.back())
+                    knots.push_back(row[0].y);
+            }
+            if (std::max(max_y, sample.back()[0].y) > knots.back())
+                knots.push_back(std::max(max_y, sample.back()[0].y));
+            cells = std::max(0, (int)knots.size() - 1);
+            stride = 16 * (n + 1);
+            const bool tensors = interp_type == gsl_interp_linear || interp_type == gsl_interp_cspline;
+
+            logger.debug("making cell tensors...");
+            tensor.resize(tensors ? (size_t)cells * stride : 0);
+            direct.assign(cells, ! tensors);
+            if (tensors) {
+                #pragma omp parallel
+                {
+                    std::vector<double> z(n), f(4 * 4 * (n + 1));
+                    std::unique_ptr<Interp> row_interp;
+                    #pragma omp for
+                    for (int k = 0;  k < cells;  k++) {
+                        for (int s = 0;  s < 4 && ! direct[k];  s++) {
+                            const Interp *r = row_at(knots[k] + s / 3. * (knots[k+1] - knots[k]), z, row_interp);
+                            if (r && r->size() == n)
+                                r->pieces(&f[s * 4 * (n + 1)]);
+                            else
+                                direct[k] = true;
+                        }
+                        if (direct[k])
+                            continue;
+                        double *T = &tensor[(size_t)k * stride];
+                        for (int i = 0;  i < 4 * (n + 1);  i++)
+                            cubic_through_thirds(f[i], f[4 * (n + 1) + i], f[8 * (n + 1) + i], f[12 * (n + 1) + i], T + 4 * i);
                     }
                 }
-                Interp row_interp(interp_type, x, z);
-                for (int xi = 0;  xi < width;  xi++) {
-                    double t = (double)xi / width,
-                           x = t*max_x + (1.-t)*min_x;
-                    surface(xi, yi) = row_interp.eval(x);
+            }
+        }
+
+        void rows(int y0, int rows, float *out_rows) const {
+            #pragma omp parallel
+            {
+                std::vector<double> z(n), c(4 * (n + 1));
+                std::unique_ptr<Interp> row_interp;
+                #pragma omp for
+                for (int yi = y0;  yi < y0 + rows;  yi++) {
+                    double t = (double)yi / height,
+                           y = t*max_y + (1.-t)*min_y;
+                    const int k = std::min(std::max((int)(std::upper_bound(knots.begin(), knots.end(), y) - knots.begin()) - 1, 0), cells - 1);
+
+                    // c gets the row's pieces from the cell's tensor, or from the row's own interpolator
+                    const Interp *r = NULL;
+                    bool ready = false;
+                    if (k >= 0 && ! direct[k]) {
+                        const double *T = &tensor[(size_t)k * stride],
+                                     v = (y - knots[k]) / (knots[k+1] - knots[k]);
+                        for (int i = 0;  i < 4 * (n + 1);  i++) {
+                            const double *q = T + 4 * i;
+                            c[i] = q[0] + v * (q[1] + v * (q[2] + v * q[3]));
+                        }
+                        ready = true;
+                    }
+                    else if ((r = row_at(y, z, row_interp)) && interp_type != gsl_interp_polynomial && r->size() == n) {
+                        r->pieces(&c[0]);
+                        ready = true;
+                    }
+
+                    float *out = out_rows + (size_t)(yi - y0) * width;
+                    if (ready) {
+                        for (int xi = 0;  xi < width;  xi++) {
+                            const double *p = &c[4 * piece[xi]],
+                                         u = local[xi];
+                            out[xi] = p[0] + u * (p[1] + u * (p[2] + u * p[3]));
+                        }
+                    }
+                    else if (r) {
+                        for (int xi = 0;  xi < width;  xi++) {
+                            double t = (double)xi / width,
+                                   x = t*max_x + (1.-t)*min_x;
+                            out[xi] = r->eval(x);
+                        }
+                    }
+                    else {
+                        std::fill(out, out + width, NAN);
+                    }
                 }
             }
+        }
 
+    };
+
+
+    class SplineSurfaceImpl : public astralcat::SplineSurface {
+        double y;
+        const gsl_interp_type *interp_type;
+        std::vector< std::vector<Sample> > sample;
+        int y_index;
+
+    public:
+
+        SplineSurfaceImpl(const gsl_interp_type *interp_type) : interp_type(interp_type)
+        {
+        }
+
+        void set_y(double y) {
+            this->y = y;
+            sample.push_back({});
+            y_index = sample.size() - 1;
+        }
+
+        void add_xz(double x, double z) {
+            sample[y_index].push_back({x, y, z});
+        }
+
+        mdarray_float surface(double min_x, double max_x, double min_y, double max_y, int width, int height) const {
+            const auto e = evaluator(min_x, max_x, min_y, max_y, width, height);
+            mdarray_float surface(false, width, height);
+            if (height > 0)
+                e->rows(0, height, surface.array_ptr(0, 0));
             return surface;
         }
 
+        Evaluator::PTR evaluator(double min_x, double max_x, double min_y, double max_y, int width, int height) const {
+            auto log_indent = logger.info("evaluating surface...").indent();
+            return std::make_shared<SurfaceEvaluator>(interp_type, sample, min_x, max_x, min_y, max_y, width, height);
+        }
+
     };
 
 }
@@ -9,6 +9,8 @@
 #include <map>
 #include <assert.h>
 #include <tuple>
+#include <functional>
+#include <stdint.h>
 #include "sfitsio.h"
 #include "Logger.h"
 #include "vec.h"
@@ -32,10 +34,19 @@ namespace astralcat {
     class SplineSurface {
     public:
         typedef std::shared_ptr<SplineSurface> PTR;
+        // surface() kept as its column interpolators and cell tensors, for rows of it on demand
+        class Evaluator {
+        public:
+            typedef std::shared_ptr<const Evaluator> PTR;
+            virtual ~Evaluator() {}
+            // rows [y0, y0 + rows) of the surface into out, rows x width floats
+            virtual void rows(int y0, int rows, float *out) const = 0;
+        };
         static PTR initialize(const char *interp_type);
         virtual void set_y(double y) = 0;
         virtual void add_xz(double x, double z) = 0;
         virtual sli::mdarray_float surface(double min_x, double max_x, double min_y, double max_y, int width, int height) const = 0;
+        virtual Evaluator::PTR evaluator(double min_x, double max_x, double min_y, double max_y, int width, int height) const = 0;
     };
 
 
@@ -51,22 +62,53 @@ namespace astralcat {
         virtual sli::mdarray_float surface(double min_x, double max_x, double min_y, double max_y, int width, int height) const = 0;
         virtual Coeff2D getCoeff() const = 0;
         static PTR iterative_fit(sli::mdarray_float &section, int order, double clipping_sigma = 3., int repeat = 3,int step = 1);
+        // iterative_fit of every cellsize x cellsize cell of src, returned as the surfaces;
+        // the cells share one normal matrix.  Cells that cannot be fitted are NaN.
+        static sli::mdarray_float grid_fit(const sli::mdarray_float &src, int cellsize, int order, double clipping_sigma = 3., int repeat = 3);
+        // grid_fit kept as the coefficients of each cell, for rows of the surface on demand
+        struct Grid {
+            int width, height, cellsize, order;
+            std::vector<double> coeff;      // order (order + 1) / 2 per cell, NaN where it failed
+            void rows(int y0, int rows, float *out) const;
+        };
+        static Grid grid_fit_cells(const sli::mdarray_float &src, int cellsize, int order, double clipping_sigma = 3., int repeat = 3);
     };
 
 
+    // mesh statistics: one value per binsize x binsize cell, cell (gx, gy) centred at
+    // ((gx + 0.5) binsize, (gy + 0.5) binsize).  The statistic may modify the cell.
+    typedef std::function<double(sli::mdarray_float &cell)> MeshStatistic;
+    // clipped_mean, median, mode, polynomial (centre of a clipped fit) or poly_stddev
+    MeshStatistic mesh_statistic(const char *name, double clipping_sigma = 3.);
+    sli::mdarray_float mesh(const sli::mdarray_float &data, int binsize, const MeshStatistic &statistic);
+
+
+    class BitPlane;
+
+
     class SkyEstimator {
     public:
         typedef std::shared_ptr<SkyEstimator> PTR;
         static PTR initialize(const char *str, const sli::mdarray_float &data);
+        // pixels set in mask do not contribute to the sky
+        static PTR initialize(const char *str, const sli::mdarray_float &data, const BitPlane &mask);
         virtual ~SkyEstimator() {}
         virtual sli::mdarray_float surface() const = 0;
+        // rows [y0, y0 + rows) of the surface into out, rows x width floats;
+        // the default cuts them from surface()
+        virtual void surface_rows(int y0, int rows, float *out) const;
+        // data -= surface (or += for add) a band of rows at a time, without the full-frame surface
+        void subtract(sli::mdarray_float &data) const;
+        void add(sli::mdarray_float &data) const;
     };
 
 
     // Source
     struct Source : public vec2 {
         double flux;
-        Source(const vec2& p = {0., 0.}, double flux = 0.) : vec2(p), flux(flux) {}
+        // second-moment shape: semi-axes (pixels), position angle from +x (radians), 1 - b/a
+        double a, b, theta, ellipticity;
+        Source(const vec2& p = {0., 0.}, double flux = 0.) : vec2(p), flux(flux), a(0.), b(0.), theta(0.), ellipticity(0.) {}
     };
     std::ostream &operator<<(std::ostream &os, const Source &s);
     std::istream &operator>>(std::istream &is, Source &s);
@@ -83,8 +125,58 @@ namespace astralcat {
     }
 
 
+    // mask plane bits
+    enum {
+        DETECTED  = 1 << 0,
+        SOURCE    = 1 << 1,
+        SATURATED = 1 << 2,
+        COSMICRAY = 1 << 3
+    };
+
+
+    /*
+     * a mask plane of one flag, one bit per pixel and 64 pixels per word.
+     * pixel x of a row is bit x % 64 of word x / 64; the bits past the width stay 0.
+     * dilate() and erode() use a (2r + 1)^2 square; outside the plane counts as unset
+     * for dilate() and as set for erode().
+     */
+    class BitPlane {
+        int w, h, stride;
+        std::vector<uint64_t> bits;
+        void clear_padding();
+    public:
+        BitPlane(int width = 0, int height = 0);
+        int width() const  { return w; }
+        int height() const { return h; }
+        int words() const  { return stride; }
+        uint64_t *row(int y)             { return &bits[(size_t)y * stride]; }
+        const uint64_t *row(int y) const { return &bits[(size_t)y * stride]; }
+        static bool test(const uint64_t *row, int x) { return row[x >> 6] >> (x & 63) & 1; }
+        bool get(int x, int y) const { return test(row(y), x); }
+        void set(int x, int y)   { row(y)[x >> 6] |=   uint64_t(1) << (x & 63); }
+        void reset(int x, int y) { row(y)[x >> 6] &= ~(uint64_t(1) << (x & 63)); }
+        BitPlane &operator|=(const BitPlane &other);
+        BitPlane &operator&=(const BitPlane &other);
+        BitPlane &and_not(const BitPlane &other);
+        BitPlane dilate(int r = 1) const;
+        BitPlane erode(int r = 1) const;
+        long count() const;
+        static BitPlane from_mask(const sli::mdarray_uchar &mask, unsigned char flag);
+        void to_mask(sli::mdarray_uchar &mask, unsigned char flag) const;
+        void fill(sli::mdarray_float &data, double value) const;
+    };
+
+
+    // cosmic rays; returns the number of pixels newly marked COSMICRAY in mask
+    int find_cosmic_rays(const char *cr_desc, const sli::mdarray_float &data, sli::mdarray_uchar &mask);
+
+
     // detection
-    std::vector<Source> detect(const char *dd_str, const sli::mdarray_float &surface);
+    // pixels set in mask are skipped; footprints receives the pixels of the sources
+    std::vector<Source> detect(const char *dd_str, const sli::mdarray_float &surface, const BitPlane *mask = nullptr, BitPlane *footprints = nullptr);
+    void detect_stream(const char *dd_str, const char *filename, const std::function<void(const Source &)> &emit);
+    // gaussian or moffat profile fits of the positions and shapes; the fluxes stay those of detect()
+    std::vector<Source> fit_psf(const char *psf_desc, const sli::mdarray_float &data, const std::vector<Source> &sources);
 
 
     // mosaic & stack
@@ -105,14 +197,66 @@ namespace astralcat {
     };
 
     std::vector<Source> mergeSource(const Warper &warper, const std::vector<Source> &ref, const std::vector<Source> &src, double match_radius);
+    Warper inverse(const Warper &warper, double min_x, double max_x, double min_y, double max_y);
 
     class Stacker {
         struct Impl;
         std::shared_ptr<Impl> pimpl;
     public:
-        Stacker();
+        Stacker(const char *stack_desc = "");
         void add(const Warper &forward_warper, const char *filename);
         void stack(const char *output_file);
+        void load_state(const char *state_file);
+        void save_state(const char *state_file);
+    };
+
+
+    // forced photometry at fixed reference positions
+    struct Photometry {
+        // per second of the frame's EXPTIME, where it has one
+        std::vector<double> flux;   // one per aperture radius, sky subtracted; NaN if a pixel is missing
+        double sky, sky_stddev;     // per pixel, in the annulus
+    };
+
+    class Photometer {
+        struct Impl;
+        std::shared_ptr<Impl> pimpl;
+    public:
+        Photometer(const char *phot_desc = "");
+        void add(const Warper &forward_warper, const char *filename);
+        const std::vector<double> &radii() const;
+        // result[frame][source] for the frames in the order they were added
+        std::vector< std::vector<Photometry> > measure(const std::vector<Source> &catalog);
+    };
+
+
+    // row streaming fits io
+    class FitsRowReader {
+        struct Impl;
+        std::shared_ptr<Impl> pimpl;
+    public:
+        FitsRowReader(const char *filename, long hdu_index = 0);
+        int width() const;
+        int height() const;
+        double header(const char *key, double default_value = NAN) const;
+        sli::mdarray_float read(int y0, int rows);
+        // only rows from y on of the last read are kept for the next one (all are by default);
+        // a read starting below the kept rows goes back to the start of the file
+        void keep_from(int y);
+    };
+
+    // EXTNAME of each image HDU from the primary one up to the first other HDU ("" if
+    // unnamed), from the headers alone
+    std::vector<std::string> fits_image_extnames(const char *filename);
+
+    class FitsRowWriter {
+        struct Impl;
+        std::shared_ptr<Impl> pimpl;
+    public:
+        // an extension HDU (XTENSION) instead of the primary one, to be appended to another file
+        FitsRowWriter(const char *filename, int width, int height, const char *extname, bool extension = false);
+        void write(const sli::mdarray_float &rows);
+        void close();
     };
 
 
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# stacks the same exposures with resampler=exact and resampler=table and reports
+# the time of each and the aperture fluxes of the table stack relative to the exact
+# one, at the sources detected on the exact stack.
+#
+#   ./compare_resamplers.sh [STITCH_OPTIONS...] -- CAT1 CAT2...CATN IMG1 IMG2...IMGN
+#
+set -e
+
+options=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    options="$options $1"
+    shift
+done
+[ "$1" = "--" ] && shift
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [STITCH_OPTIONS...] -- CAT1 CAT2...CATN IMG1 IMG2...IMGN" >&2
+    exit 1
+fi
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for resampler in exact table; do
+    start=$(date +%s.%N)
+    ./stitch -o "$dir/$resampler.fits" $options --stack="resampler=$resampler" "$@" 2> "$dir/$resampler.log"
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v r=$resampler '{ printf "%-5s %8.2f s\n", r, $2 - $1 }'
+done
+
+./sky --catalog="$dir/ref.txt" --detect='min_area=5 detect_threshold=10' "$dir/exact.fits" 2> /dev/null
+for resampler in exact table; do
+    ./phot -o "$dir/$resampler.phot" -r "$dir/ref.txt" --phot='radii=3,5,8' "$dir/ref.txt" "$dir/$resampler.fits" 2> /dev/null
+done
+
+# columns 7... are flux_3, flux_5 and flux_8; both files list the sources in the same order
+awk '
+    /^#/ { if (NR == FNR) for (i = 7;  i < NF;  i++) name[i] = $(i + 1);  next }
+    NR == FNR { for (i = 7;  i <= NF;  i++) exact[FNR, i] = $i;  n = NF;  next }
+    {
+        for (i = 7;  i <= NF;  i++) {
+            e = exact[FNR, i];
+            if (tolower(e $i) !~ /nan|inf/ && e > 0) {
+                d = $i / e - 1;
+                count[i]++;  sum[i] += d;  sum2[i] += d * d;
+                if (d < 0) d = -d;
+                if (d > max[i]) max[i] = d;
+            }
+        }
+    }
+    END {
+        for (i = 7;  i <= n;  i++) {
+            if (count[i] == 0) continue;
+            m = sum[i] / count[i];
+            printf "%-8s %6d sources  table/exact - 1: mean % .2e  rms %.2e  max %.2e\n", name[i], count[i], m, sqrt(sum2[i] / count[i]), max[i];
+        }
+    }
+' "$dir/exact.phot" "$dir/table.phot"
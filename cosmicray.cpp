@@ -0,0 +1,261 @@
+// cosmic ray rejection after L.A.Cosmic (van Dokkum 2001, PASP 113, 1420).
+// cosmic rays are sharper than any PSF: their Laplacian is large against both the noise
+// and the fine structure of the image, which stars and galaxies are not.
+#include "astralcat.h"
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+using namespace sli;
+using namespace astralcat;
+using std::string;
+
+
+namespace {
+
+    inline int clamp(int i, int n) {
+        return i < 0 ? 0 : i >= n ? n - 1 : i;
+    }
+
+
+    // positive part of the 5-point laplacian, as (2 -1 -1) along x plus along y
+    mdarray_float laplacian(const mdarray_float &src) {
+        const int width  = src.length(0),
+                  height = src.length(1);
+        mdarray_float dst(false, width, height);
+        #pragma omp parallel for
+        for (int y = 0;  y < height;  y++) {
+            const float *up   = src.array_ptr(0, clamp(y - 1, height)),
+                        *row  = src.array_ptr(0, y),
+                        *down = src.array_ptr(0, clamp(y + 1, height));
+            float *out = dst.array_ptr(0, y);
+            for (int x = 0;  x < width;  x++) {
+                const float l = row[clamp(x - 1, width)],
+                            r = row[clamp(x + 1, width)];
+                out[x] = std::max(0.f, 4.f * row[x] - l - r - up[x] - down[x]);
+            }
+        }
+        return dst;
+    }
+
+
+    inline void sort2(float &a, float &b) {
+        const float lo = std::min(a, b);
+        b = std::max(a, b);
+        a = lo;
+    }
+
+
+    // median of the finite values of buf[0, n), or NaN if none; buf is reordered
+    float finite_median(float *buf, int n) {
+        float *end = std::partition(buf, buf + n, [](float v) { return isfinite(v); });
+        if (end == buf)
+            return NAN;
+        float *m = buf + (end - buf) / 2;
+        std::nth_element(buf, m, end);
+        return *m;
+    }
+
+
+    /*
+     * exact 3x3 median of the finite values.
+     * the columns of three are sorted once per row triple; the median is then the median
+     * of (max of the minima, median of the medians, min of the maxima) over three columns.
+     * everything is min/max over contiguous rows, which the compiler vectorises.  min/max
+     * do not order NaN, so windows with a non-finite pixel are redone by finite_median.
+     */
+    mdarray_float median3(const mdarray_float &src) {
+        const int width  = src.length(0),
+                  height = src.length(1);
+        mdarray_float dst(false, width, height);
+        #pragma omp parallel
+        {
+            std::vector<float> lo(width), mid(width), hi(width);
+            std::vector<char> bad(width);
+            #pragma omp for
+            for (int y = 0;  y < height;  y++) {
+                const float *a = src.array_ptr(0, clamp(y - 1, height)),
+                            *b = src.array_ptr(0, y),
+                            *c = src.array_ptr(0, clamp(y + 1, height));
+                for (int x = 0;  x < width;  x++) {
+                    bad[x] = ! (isfinite(a[x]) && isfinite(b[x]) && isfinite(c[x]));
+                    float p = a[x], q = b[x], r = c[x];
+                    sort2(p, q);
+                    sort2(q, r);
+                    sort2(p, q);
+                    lo[x] = p;
+                    mid[x] = q;
+                    hi[x] = r;
+                }
+                float *out = dst.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    const int l = clamp(x - 1, width),
+                              r = clamp(x + 1, width);
+                    float p = std::max(std::max(lo[l], lo[x]), lo[r]),
+                          q = mid[l], m = mid[x], s = mid[r],
+                          t = std::min(std::min(hi[l], hi[x]), hi[r]);
+                    sort2(q, m);
+                    sort2(m, s);
+                    sort2(q, m);
+                    sort2(p, m);
+                    sort2(m, t);
+                    sort2(p, m);
+                    out[x] = m;
+                }
+                for (int x = 0;  x < width;  x++) {
+                    const int l = clamp(x - 1, width),
+                              r = clamp(x + 1, width);
+                    if (bad[l] || bad[x] || bad[r]) {
+                        float buf[9] = {a[l], a[x], a[r], b[l], b[x], b[r], c[l], c[x], c[r]};
+                        out[x] = finite_median(buf, 9);
+                    }
+                }
+            }
+        }
+        return dst;
+    }
+
+
+    /*
+     * separable n x n median: the median along x of the medians along y, of the finite
+     * values (NaN if there are none).
+     * it is not the true 2-d median, but as robust for the smooth structure it removes
+     * and costs 2n instead of n^2 comparisons per pixel.
+     */
+    mdarray_float separable_median(const mdarray_float &src, int n) {
+        const int width  = src.length(0),
+                  height = src.length(1),
+                  h = n / 2;
+        mdarray_float tmp(false, width, height),
+                      dst(false, width, height);
+        #pragma omp parallel
+        {
+            std::vector<float> buf(n);
+            std::vector<const float *> rows(n);
+            #pragma omp for
+            for (int y = 0;  y < height;  y++) {
+                for (int k = 0;  k < n;  k++)
+                    rows[k] = src.array_ptr(0, clamp(y + k - h, height));
+                float *out = tmp.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    for (int k = 0;  k < n;  k++)
+                        buf[k] = rows[k][x];
+                    out[x] = finite_median(&buf[0], n);
+                }
+            }
+            #pragma omp for
+            for (int y = 0;  y < height;  y++) {
+                const float *row = tmp.array_ptr(0, y);
+                float *out = dst.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    for (int k = 0;  k < n;  k++)
+                        buf[k] = row[clamp(x + k - h, width)];
+                    out[x] = finite_median(&buf[0], n);
+                }
+            }
+        }
+        return dst;
+    }
+
+}
+
+
+namespace astralcat {
+
+    /*
+     * marks pixels hit by cosmic rays with COSMICRAY in mask.
+     * S = L+ / N is the laplacian against the noise N from gain and readnoise, and
+     * F = M3 - M7(M3) the fine structure.  A pixel is hit if S - M5(S) > sigclip and
+     * L+ / F > objlim; its neighbours are added down to sigfrac * sigclip.  Hits are
+     * replaced by the local median before the next of niter iterations.
+     */
+    int find_cosmic_rays(const char *cr_desc, const mdarray_float &data, mdarray_uchar &mask) {
+        auto args = parse_keyvalue(cr_desc);
+        reverse_merge(args, {{"sigclip",   "4.5"},
+                             {"sigfrac",   "0.3"},
+                             {"objlim",    "5.0"},
+                             {"gain",      "1.0"},
+                             {"readnoise", "6.5"},
+                             {"niter",     "2"}});
+        logger.info("parameters: %s", boost::lexical_cast<string>(args));
+
+        const double sigclip = atof(args["sigclip"].c_str()),
+                     sigfrac = atof(args["sigfrac"].c_str()),
+                     objlim = atof(args["objlim"].c_str()),
+                     gain = atof(args["gain"].c_str()),
+                     readnoise = atof(args["readnoise"].c_str());
+        const int niter = atoi(args["niter"].c_str()),
+                  width  = data.length(0),
+                  height = data.length(1);
+        if (! (gain > 0.))
+            throw std::invalid_argument((boost::format("invalid gain: %s") % args["gain"]).str());
+
+        mdarray_float image = data;
+        int total = 0;
+        for (int iter = 0;  iter < niter;  iter++) {
+            const mdarray_float lap = laplacian(image),
+                                m3 = median3(image),
+                                m5 = separable_median(image, 5),
+                                fine = m3 - separable_median(m3, 7);
+
+            mdarray_float snr(false, width, height);
+            #pragma omp parallel for
+            for (int y = 0;  y < height;  y++) {
+                const float *l = lap.array_ptr(0, y),
+                            *m = m5.array_ptr(0, y);
+                float *s = snr.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++)
+                    s[x] = l[x] * gain / sqrt(gain * std::max(0.f, m[x]) + readnoise * readnoise);
+            }
+            const mdarray_float snr_prime = snr - separable_median(snr, 5);
+
+            // hits, then their neighbours at the lower limit
+            mdarray_uchar hit(false, width, height);
+            #pragma omp parallel for
+            for (int y = 0;  y < height;  y++) {
+                const float *s = snr_prime.array_ptr(0, y),
+                            *l = lap.array_ptr(0, y),
+                            *f = fine.array_ptr(0, y),
+                            *m = m5.array_ptr(0, y);
+                unsigned char *h = hit.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    // no hit where a median is not finite (masked or cropped pixels around)
+                    h[x] = isfinite(m[x]) && isfinite(f[x]) && isfinite(s[x]) &&
+                           s[x] > sigclip && l[x] > objlim * std::max(f[x], 0.01f);
+                }
+            }
+            int found = 0;
+            #pragma omp parallel for reduction(+:found)
+            for (int y = 0;  y < height;  y++) {
+                const float *s = snr_prime.array_ptr(0, y);
+                unsigned char *out = mask.array_ptr(0, y);
+                float *z = image.array_ptr(0, y);
+                const float *m = m5.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    bool grow = false;
+                    for (int yy = std::max(0, y - 1);  yy <= std::min(height - 1, y + 1);  yy++) {
+                        const unsigned char *h = hit.array_ptr(0, yy);
+                        for (int xx = std::max(0, x - 1);  xx <= std::min(width - 1, x + 1);  xx++)
+                            grow |= h[xx];
+                    }
+                    // masked pixels are not hits, and only a finite median replaces one
+                    if (grow && s[x] > sigfrac * sigclip && ! (out[x] & COSMICRAY) &&
+                        isfinite(z[x]) && isfinite(m[x])) {
+                        found++;
+                        out[x] |= COSMICRAY;
+                        z[x] = m[x];
+                    }
+                }
+            }
+
+            logger.info("iteration %d: %d pixels", iter + 1, found);
+            total += found;
+            if (found == 0)
+                break;
+        }
+
+        return total;
+    }
+
+}
@@ -2,7 +2,11 @@
 #include <sli/mdarray_statistics.h>
 #include <boost/format.hpp>
 #include <algorithm>
-#include <boost/numeric/ublas/exception.hpp>
+#include <limits>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <omp.h>
 #include <boost/lexical_cast.hpp>
 
 
@@ -14,98 +18,568 @@ using std::string;
 namespace {
 
 
-    enum {
-        DETECTED  = 1 << 0,
-        SOURCE    = 1 << 1,
-        SATURATED = 1 << 2,
-        COSMICRAY = 1 << 3
-    };
-
-
-    void mark_detected(const mdarray_float &data, mdarray_uchar &mask, double threshold) {
+    void mark_detected(const mdarray_float &data, BitPlane &detected, double threshold) {
+        #pragma omp parallel for
         for (int y = 0;  y < data.length(1);  y++) {
+            const float *row = data.array_ptr(0, y);
             for (int x = 0 ;  x < data.length(0);  x++) {
-                if (data(x, y) >= threshold)
-                    mask(x, y) |= DETECTED;
+                if (row[x] >= threshold)
+                    detected.set(x, y);
             }
         }
     }
 
-    struct point_t {
-        int x;
-        int y;
+    /*
+     * 8-connected components of the DETECTED pixels.
+     * strips of rows are scanned in parallel into a union-find forest whose links always
+     * point to a smaller pixel index, the forests are joined across strip boundaries and
+     * every pixel is then resolved to its root.  So the root of a component is its first
+     * pixel in raster order, and components are numbered in that order (from 1; 0 is
+     * background) exactly as a raster scan would meet them.
+     * the statistics of a component are accumulated over its own pixels only.
+     */
+    struct Component {
+        int min_x, max_x, min_y, max_y;
+        int area;
+        // sums of I, xI, yI, xxI, yyI and xyI, and the brightest I
+        double flux, sx, sy, sxx, syy, sxy, peak;
+
+        Component() :
+            min_x(std::numeric_limits<int>::max()), max_x(-1),
+            min_y(std::numeric_limits<int>::max()), max_y(-1),
+            area(0), flux(0.), sx(0.), sy(0.), sxx(0.), syy(0.), sxy(0.),
+            peak(- std::numeric_limits<double>::infinity())
+        {
+        }
+
+        void add(int x, int y, double z) {
+            min_x = std::min(min_x, x);
+            max_x = std::max(max_x, x);
+            min_y = std::min(min_y, y);
+            max_y = std::max(max_y, y);
+            area++;
+            flux += z;
+            sx  += x * z;
+            sy  += y * z;
+            sxx += (double)x * x * z;
+            syy += (double)y * y * z;
+            sxy += (double)x * y * z;
+            peak = std::max(peak, z);
+        }
+
+        void merge(const Component &o) {
+            min_x = std::min(min_x, o.min_x);
+            max_x = std::max(max_x, o.max_x);
+            min_y = std::min(min_y, o.min_y);
+            max_y = std::max(max_y, o.max_y);
+            area += o.area;
+            flux += o.flux;
+            sx  += o.sx;
+            sy  += o.sy;
+            sxx += o.sxx;
+            syy += o.syy;
+            sxy += o.sxy;
+            peak = std::max(peak, o.peak);
+        }
     };
 
-    bool point_compare_x(const point_t &a, const point_t &b) { return a.x < b.x; }
-    bool point_compare_y(const point_t &a, const point_t &b) { return a.y < b.y; }
 
+    class Labeling {
+        const int width, height;
+        std::vector<int> parent;
+
+        int find(int i) const {
+            while (parent[i] != i)
+                i = parent[i];
+            return i;
+        }
+
+        // links the larger root under the smaller one; returns the new root
+        int unite(int i, int j) {
+            i = find(i);
+            j = find(j);
+            if (i < j)
+                std::swap(i, j);
+            parent[i] = j;
+            return j;
+        }
+
+        void scan_strip(const BitPlane &detected, int y0, int y1) {
+            for (int y = y0;  y < y1;  y++) {
+                const uint64_t *row = detected.row(y),
+                               *prev = y > y0 ? detected.row(y - 1) : nullptr;
+                for (int x = 0;  x < width;  x++) {
+                    const int i = x + y * width;
+                    if (! BitPlane::test(row, x)) {
+                        parent[i] = -1;
+                        continue;
+                    }
+                    int root = parent[i] = i;
+                    if (x > 0 && BitPlane::test(row, x - 1))
+                        root = unite(root, i - 1);
+                    if (prev) {
+                        for (int xx = std::max(0, x - 1);  xx <= std::min(width - 1, x + 1);  xx++) {
+                            if (BitPlane::test(prev, xx))
+                                root = unite(root, xx + (y - 1) * width);
+                        }
+                    }
+                    // keep the trees shallow for the resolve pass
+                    parent[i] = root;
+                }
+            }
+        }
+
+        void join_strips(const BitPlane &detected, int y) {
+            const uint64_t *row = detected.row(y),
+                           *prev = detected.row(y - 1);
+            for (int x = 0;  x < width;  x++) {
+                if (! BitPlane::test(row, x))
+                    continue;
+                for (int xx = std::max(0, x - 1);  xx <= std::min(width - 1, x + 1);  xx++) {
+                    if (BitPlane::test(prev, xx))
+                        unite(x + y * width, xx + (y - 1) * width);
+                }
+            }
+        }
+
+    public:
+        mdarray_int labels;
+        std::vector<Component> components;
+
+        // data is measured under the components
+        Labeling(const BitPlane &detected, const mdarray_float &data) :
+            width(detected.width()),
+            height(detected.height()),
+            parent((size_t)width * height),
+            labels(false, width, height)
+        {
+            const int strips = std::max(1, std::min(omp_get_max_threads(), height)),
+                      strip_height = (height + strips - 1) / strips;
+
+            #pragma omp parallel for
+            for (int s = 0;  s < strips;  s++)
+                scan_strip(detected, s * strip_height, std::min(height, (s + 1) * strip_height));
 
-    Source measure(const std::vector<point_t> &pixels, const mdarray_float &data) {
-        const int e = 0;
-        int min_x = std::min_element(pixels.begin(), pixels.end(), point_compare_x)->x - e,
-            max_x = std::max_element(pixels.begin(), pixels.end(), point_compare_x)->x + e,
-            min_y = std::min_element(pixels.begin(), pixels.end(), point_compare_y)->y - e,
-            max_y = std::max_element(pixels.begin(), pixels.end(), point_compare_y)->y + e;
+            for (int y = strip_height;  y < height;  y += strip_height)
+                join_strips(detected, y);
 
-        double cx = 0., cy = 0., flux = 0.;
-        for (int x = min_x;  x <= max_x;  x++) {
-            for (int y = min_y;  y <= max_y;  y++) {
-                cx += x * data(x, y);
-                cy += y * data(x, y);
-                flux += data(x, y);
+            // number the roots strip by strip, then resolve every pixel to its root's number
+            std::vector<int> roots(strips + 1, 0);
+            #pragma omp parallel for
+            for (int s = 0;  s < strips;  s++) {
+                for (int i = s * strip_height * width;  i < std::min(height, (s + 1) * strip_height) * width;  i++)
+                    roots[s + 1] += parent[i] == i;
             }
+            for (int s = 0;  s < strips;  s++)
+                roots[s + 1] += roots[s];
+
+            std::vector<int> number(parent.size());
+            #pragma omp parallel for
+            for (int s = 0;  s < strips;  s++) {
+                int n = roots[s];
+                for (int i = s * strip_height * width;  i < std::min(height, (s + 1) * strip_height) * width;  i++) {
+                    if (parent[i] == i)
+                        number[i] = ++n;
+                }
+            }
+
+            #pragma omp parallel for
+            for (int y = 0;  y < height;  y++) {
+                int *row = labels.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    const int i = x + y * width;
+                    row[x] = parent[i] < 0 ? 0 : number[find(i)];
+                }
+            }
+
+            measure_components(data, roots, strip_height);
         }
-        cx /= flux;
-        cy /= flux;
 
-        return {{cx, cy}, flux};
+    private:
+        /*
+         * strip s owns the labels (roots[s], roots[s + 1]] of the components rooted in it
+         * and adds its pixels of them straight to components; the few components that
+         * reach in from the strips above go to a map of the strip's own, merged at the end.
+         */
+        void measure_components(const mdarray_float &data, const std::vector<int> &roots, int strip_height) {
+            const int strips = roots.size() - 1;
+            components.assign(roots[strips], Component());
+            std::vector< std::unordered_map<int, Component> > foreign(strips);
+            #pragma omp parallel for
+            for (int s = 0;  s < strips;  s++) {
+                for (int y = s * strip_height;  y < std::min(height, (s + 1) * strip_height);  y++) {
+                    const int *row = labels.array_ptr(0, y);
+                    const float *z = data.array_ptr(0, y);
+                    for (int x = 0;  x < width;  x++) {
+                        if (row[x] > roots[s])
+                            components[row[x] - 1].add(x, y, z[x]);
+                        else if (row[x] > 0)
+                            foreign[s][row[x]].add(x, y, z[x]);
+                    }
+                }
+            }
+            for (const auto &f: foreign) {
+                for (const auto &kv: f)
+                    components[kv.first - 1].merge(kv.second);
+            }
+        }
+    };
+
+
+    // centroid, flux and the shape of the second moments
+    Source measure(const Component &c) {
+        const double cx = c.sx / c.flux,
+                     cy = c.sy / c.flux,
+                     xx = c.sxx / c.flux - cx * cx,
+                     yy = c.syy / c.flux - cy * cy,
+                     xy = c.sxy / c.flux - cx * cy,
+                     h = 0.5 * (xx + yy),
+                     r = sqrt(0.25 * (xx - yy) * (xx - yy) + xy * xy);
+
+        Source s({cx, cy}, c.flux);
+        s.a = sqrt(std::max(0., h + r));
+        s.b = sqrt(std::max(0., h - r));
+        s.theta = 0.5 * atan2(2. * xy, xx - yy);
+        s.ellipticity = s.a > 0. ? 1. - s.b / s.a : 0.;
+        return s;
     }
 
 
-    std::vector<Source> pickup_connecting_pixels(const mdarray_float &surface, mdarray_uchar &mask, int min_area, double min_flux) {
-        std::vector<Source> sources;
+    /*
+     * SExtractor-style deblending on a max-tree of one component.
+     * pixel values are quantised to nthresh levels spaced exponentially between the
+     * detection threshold and the component's peak, and the tree of the connected sets
+     * at every level is built once (Berger et al. 2007, O(N log N)).  A node whose
+     * subtrees hold two or more branches with at least mincont of the component's flux
+     * and min_area pixels is split; the pixels below the split go to the nearest branch.
+     */
+    struct Deblending {
+        int nthresh;
+        double mincont;
+        int min_area;
+        double threshold;
+    };
+
+
+    class MaxTree {
+        const mdarray_int &labels;
+        const mdarray_float &data;
+        const Component &component;
+        const int label, x0, y0, width, height;
+        std::vector<int> index;                     // bbox pixel -> node, -1 outside the component
+        std::vector<int> pixels, level, parent;     // node -> bbox pixel, quantised level, parent node
+        std::vector<int> area;                      // of the subtree, valid for canonical nodes
+        std::vector<double> flux;
+        std::vector< std::vector<int> > children;   // canonical nodes only
+
+        static int find(std::vector<int> &zpar, int i) {
+            while (zpar[i] != i)
+                i = zpar[i] = zpar[zpar[i]];
+            return i;
+        }
+
+        bool canonical(int i) const {
+            return parent[i] == i || level[parent[i]] != level[i];
+        }
+
+    public:
+        MaxTree(const mdarray_int &labels, const mdarray_float &data, const Component &component, int label, const Deblending &d) :
+            labels(labels), data(data), component(component), label(label),
+            x0(component.min_x), y0(component.min_y),
+            width(component.max_x - component.min_x + 1),
+            height(component.max_y - component.min_y + 1),
+            index((size_t)width * height, -1)
+        {
+            const double log_range = log(std::max(component.peak, d.threshold) / d.threshold);
+            for (int y = 0;  y < height;  y++) {
+                for (int x = 0;  x < width;  x++) {
+                    if (labels(x + x0, y + y0) != label)
+                        continue;
+                    const double z = data(x + x0, y + y0);
+                    index[x + y * width] = pixels.size();
+                    pixels.push_back(x + y * width);
+                    level.push_back(log_range > 0. && z > d.threshold ? std::min(d.nthresh - 1, (int)(d.nthresh * log(z / d.threshold) / log_range)) : 0);
+                }
+            }
 
-        for (int y = 0;  y < mask.length(1);  y++)  for (int x = 0;  x < mask.length(0);  x++) {
-            if (mask(x, y) & DETECTED) {
-                std::vector<point_t> pixels;
-                pixels.push_back({x, y});
-                mask(x, y) &= ~DETECTED;
-                for (int done = 0;  done < pixels.size();  done++) {
-                    for (int xx = -1;  xx <= 1;  xx++)  for (int yy = -1;  yy <= 1;  yy++) {
-                        int xxx = pixels[done].x + xx,
-                            yyy = pixels[done].y + yy;
-                        if (mask(xxx, yyy) & DETECTED) {
-                            pixels.push_back({xxx, yyy});
-                            mask(xxx, yyy) &= ~DETECTED;
+            const int n = pixels.size();
+            std::vector<int> order(n);
+            for (int i = 0;  i < n;  i++)
+                order[i] = i;
+            std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return level[a] > level[b]; });
+
+            // union-find from the highest level down; parents are always added later
+            std::vector<int> zpar(n, -1);
+            parent.assign(n, -1);
+            for (int i: order) {
+                parent[i] = zpar[i] = i;
+                const int px = pixels[i] % width,
+                          py = pixels[i] / width;
+                for (int yy = std::max(0, py - 1);  yy <= std::min(height - 1, py + 1);  yy++) {
+                    for (int xx = std::max(0, px - 1);  xx <= std::min(width - 1, px + 1);  xx++) {
+                        const int j = index[xx + yy * width];
+                        if (j < 0 || zpar[j] < 0)
+                            continue;
+                        const int r = find(zpar, j);
+                        if (r != i) {
+                            parent[r] = i;
+                            zpar[r] = i;
                         }
                     }
                 }
-                if (pixels.size() >= min_area) {
-                    for (int i = 0;  i < pixels.size();  i++)
-                        mask(pixels[i].x, pixels[i].y) |= SOURCE;
-                    auto s = measure(pixels, surface);
-                    if (s.flux >= min_flux) {
-                        sources.push_back(measure(pixels, surface));
-                    }
+            }
+
+            // every node's parent becomes the canonical node of its plateau
+            for (int k = n - 1;  k >= 0;  k--) {
+                const int i = order[k],
+                          q = parent[i];
+                if (level[parent[q]] == level[q])
+                    parent[i] = parent[q];
+            }
+
+            area.assign(n, 1);
+            flux.assign(n, 0.);
+            children.assign(n, {});
+            for (int i = 0;  i < n;  i++)
+                flux[i] = data(pixels[i] % width + x0, pixels[i] / width + y0);
+            for (int i: order) {
+                if (parent[i] != i) {
+                    area[parent[i]] += area[i];
+                    flux[parent[i]] += flux[i];
+                    if (canonical(i))
+                        children[parent[i]].push_back(i);
+                }
+            }
+        }
+
+        // the root, i.e. the node processed last
+        int root() const {
+            for (int i = 0;  i < parent.size();  i++) {
+                if (parent[i] == i)
+                    return i;
+            }
+            return -1;
+        }
+
+        // the significant branches at and above node
+        std::vector<int> branches(int node, const Deblending &d, double total_flux) const {
+            std::vector<int> significant;
+            for (int c: children[node]) {
+                if (area[c] >= d.min_area && flux[c] >= d.mincont * total_flux)
+                    significant.push_back(c);
+            }
+            if (significant.size() == 1) {
+                auto b = branches(significant[0], d, total_flux);
+                return b.size() >= 2 ? b : std::vector<int>{node};
+            }
+            if (significant.empty())
+                return {node};
+            std::vector<int> objects;
+            for (int c: significant) {
+                auto b = branches(c, d, total_flux);
+                objects.insert(objects.end(), b.begin(), b.end());
+            }
+            return objects;
+        }
+
+        // the component split into one Component per branch
+        std::vector<Component> deblend(const Deblending &d) const {
+            const int r = root();
+            const auto objects = branches(r, d, flux[r]);
+            if (objects.size() <= 1)
+                return {component};
+
+            std::vector<int> object_of(parent.size(), -1);
+            for (int k = 0;  k < objects.size();  k++)
+                object_of[objects[k]] = k;
+
+            // pixels in a branch go to it, the rest wait for the centroids of the branches
+            std::vector<Component> result(objects.size());
+            std::vector<int> rest;
+            for (int i = 0;  i < parent.size();  i++) {
+                int q = canonical(i) ? i : parent[i];
+                while (object_of[q] < 0 && parent[q] != q)
+                    q = parent[q];
+                const int x = pixels[i] % width + x0,
+                          y = pixels[i] / width + y0;
+                if (object_of[q] >= 0)
+                    result[object_of[q]].add(x, y, data(x, y));
+                else
+                    rest.push_back(i);
+            }
+
+            std::vector<vec2> centers;
+            for (const auto &c: result)
+                centers.push_back({c.sx / c.flux, c.sy / c.flux});
+            for (int i: rest) {
+                const int x = pixels[i] % width + x0,
+                          y = pixels[i] / width + y0;
+                int nearest = 0;
+                for (int k = 1;  k < centers.size();  k++) {
+                    if ((centers[k] - vec2{(double)x, (double)y}).norm2() < (centers[nearest] - vec2{(double)x, (double)y}).norm2())
+                        nearest = k;
+                }
+                result[nearest].add(x, y, data(x, y));
+            }
+            return result;
+        }
+    };
+
+
+    // footprints receives the pixels of the components of at least min_area pixels
+    std::vector<Source> pickup_connecting_pixels(const mdarray_float &surface, const BitPlane &detected, BitPlane *footprints,
+                                                 int min_area, double min_flux, const Deblending &deblending) {
+        const Labeling labeling(detected, surface);
+        const auto &components = labeling.components;
+
+        if (footprints) {
+            *footprints = BitPlane(detected.width(), detected.height());
+            #pragma omp parallel for
+            for (int y = 0;  y < detected.height();  y++) {
+                const int *label = labeling.labels.array_ptr(0, y);
+                for (int x = 0;  x < detected.width();  x++) {
+                    if (label[x] > 0 && components[label[x] - 1].area >= min_area)
+                        footprints->set(x, y);
                 }
             }
         }
 
+        std::vector< std::vector<Component> > objects(components.size());
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0;  i < components.size();  i++) {
+            if (components[i].area < min_area)
+                continue;
+            if (deblending.nthresh > 1 && components[i].area >= 2 * deblending.min_area)
+                objects[i] = MaxTree(labeling.labels, surface, components[i], i + 1, deblending).deblend(deblending);
+            else
+                objects[i] = {components[i]};
+        }
+
+        std::vector<Source> sources;
+        for (const auto &o: objects) {
+            for (const auto &c: o) {
+                if (c.flux >= min_flux)
+                    sources.push_back(measure(c));
+            }
+        }
+
         return sources;
     }
 
 
-    double grid_stddev(mdarray_float &section, double clipping_sigma) try {
-        const int width  = section.length(0),
-                  height = section.length(1);
-        auto fitter = PolynomialFitter2D::iterative_fit(section, 2, clipping_sigma);
-        if ((double)valid_count(section) / section.length() <= 0.5) {
-            return NAN;
+    // 2x2 block means, NaN-aware, scaled by 2 so that unit noise stays unit noise
+    mdarray_float downsample(const mdarray_float &src) {
+        const int width  = src.length(0) / 2,
+                  height = src.length(1) / 2;
+        mdarray_float dst(false, width, height);
+        #pragma omp parallel for
+        for (int y = 0;  y < height;  y++) {
+            const float *a = src.array_ptr(0, 2 * y),
+                        *b = src.array_ptr(0, 2 * y + 1);
+            float *out = dst.array_ptr(0, y);
+            for (int x = 0;  x < width;  x++) {
+                double sum = 0.;
+                int n = 0;
+                for (float z: {a[2*x], a[2*x + 1], b[2*x], b[2*x + 1]}) {
+                    if (isfinite(z)) {
+                        sum += z;
+                        n++;
+                    }
+                }
+                out[x] = n > 0 ? 2. * sum / n : NAN;
+            }
         }
-        return md_stddev(section - fitter->surface(0, width, 0, height, width, height));
+        return dst;
     }
-    catch (const boost::numeric::ublas::singular &e) {
-        return NAN;
+
+
+    /*
+     * detection of faint extended sources on a pyramid of the noise-normalised surface.
+     * components are found `levels` halvings down, where a kernel of kernel_size is as
+     * wide as one of kernel_size << levels at full resolution; only a cut-out around each
+     * of them is then smoothed with that wide kernel and detected at full resolution,
+     * unless the component is too small for min_area or lies wholly on footprints
+     * detected already.  A refined source is kept if its centroid falls on the coarse component it came
+     * from and not on an already detected footprint.
+     */
+    std::vector<Source> detect_pyramid(const mdarray_float &surface, const BitPlane &detected_already,
+                                       int levels, int kernel_size, double gaussian_sigma,
+                                       double threshold, int min_area, double min_flux) {
+        auto log_indent = logger.info("pyramid detection: levels=%d...", levels).indent();
+        const int scale = 1 << levels,
+                  wide = kernel_size * scale;
+
+        mdarray_float coarse = surface;
+        for (int l = 0;  l < levels;  l++)
+            coarse = downsample(coarse);
+        if (kernel_size > 0)
+            coarse = convolve(coarse, gaussian_kernel(kernel_size, gaussian_sigma), kernel_size, kernel_size);
+
+        BitPlane coarse_detected(coarse.length(0), coarse.length(1));
+        mark_detected(coarse, coarse_detected, threshold);
+        const Labeling coarse_labeling(coarse_detected, coarse);
+        const auto &candidates = coarse_labeling.components;
+        const int width  = surface.length(0),
+                  height = surface.length(1);
+
+        // a candidate is worth the wide convolution only if it could hold min_area full
+        // pixels and some of its coarse pixels fall off the already detected footprints
+        std::vector<int> kept;
+        for (int i = 0;  i < candidates.size();  i++) {
+            const Component &c = candidates[i];
+            if ((long)c.area * scale * scale < min_area)
+                continue;
+            bool fresh = false;
+            for (int y = c.min_y;  y <= c.max_y && ! fresh;  y++) {
+                for (int x = c.min_x;  x <= c.max_x && ! fresh;  x++) {
+                    fresh = coarse_labeling.labels(x, y) == i + 1 &&
+                            ! detected_already.get(std::min(width - 1, x * scale + scale / 2),
+                                                   std::min(height - 1, y * scale + scale / 2));
+                }
+            }
+            if (fresh)
+                kept.push_back(i);
+        }
+        logger.info("%d candidates, %d to refine", candidates.size(), kept.size());
+
+        const mdarray_float kernel = wide > 0 ? gaussian_kernel(wide, gaussian_sigma * scale) : mdarray_float();
+        std::vector< std::vector<Source> > refined(candidates.size());
+        #pragma omp parallel for schedule(dynamic)
+        for (int k = 0;  k < kept.size();  k++) {
+            const int i = kept[k];
+            const Component &c = candidates[i];
+            // the cut-out keeps the kernel's reach around the component in full pixels
+            const int margin = wide + scale,
+                      x0 = std::max(0, c.min_x * scale - margin),
+                      y0 = std::max(0, c.min_y * scale - margin),
+                      x1 = std::min(width,  (c.max_x + 1) * scale + margin),
+                      y1 = std::min(height, (c.max_y + 1) * scale + margin);
+            if (x0 >= x1 || y0 >= y1)
+                continue;
+            mdarray_float cutout = surface.section(x0, x1 - x0, y0, y1 - y0);
+            if (wide > 0)
+                cutout = convolve(cutout, kernel, wide, wide);
+            BitPlane detected(x1 - x0, y1 - y0);
+            mark_detected(cutout, detected, threshold);
+            for (Source s: pickup_connecting_pixels(cutout, detected, nullptr, min_area, min_flux, {0, 0., 0, threshold})) {
+                s[0] += x0;
+                s[1] += y0;
+                const int x = (int)round(s[0]),
+                          y = (int)round(s[1]);
+                if (x < 0 || x >= width || y < 0 || y >= height || detected_already.get(x, y))
+                    continue;
+                if (x / scale >= coarse.length(0) || y / scale >= coarse.length(1) ||
+                    coarse_labeling.labels(x / scale, y / scale) != i + 1)
+                    continue;
+                refined[i].push_back(s);
+            }
+        }
+
+        std::vector<Source> sources;
+        for (const auto &r: refined)
+            sources.insert(sources.end(), r.begin(), r.end());
+        logger.info("%d extended sources", sources.size());
+        return sources;
     }
 
 
@@ -118,15 +592,13 @@ namespace {
 
         SplineSurface::PTR spline = SplineSurface::initialize("akima");
 
+        const mdarray_float grid = mesh(surface, binsize, mesh_statistic("poly_stddev", 2.));
         for (int gy = 0;  gy < gny;  gy++) {
             double y = (gy + 0.5) * binsize;
             spline->set_y(y);
             for (int gx = 0;  gx < gnx;  gx++) {
-                mdarray_float section, w_section;
-                section = surface.section(gx * binsize, binsize, gy *binsize, binsize);
-                double x = (gx + 0.5) * binsize,
-                       z = grid_stddev(section, 2.);
-                spline->add_xz(x, z);
+                double x = (gx + 0.5) * binsize;
+                spline->add_xz(x, grid(gx, gy));
             }
         }
 
@@ -134,21 +606,364 @@ namespace {
     }
 
 
-} // namespace
 
+    /*
+     * summed-area tables of the count, sum and sum of squares of the accepted pixels.
+     * the table entry (x, y) covers [0, x) x [0, y), so any box costs four lookups.
+     */
+    class IntegralImage {
+        const int width, height;
+        std::vector<int> n;
+        std::vector<double> s, s2;
 
-namespace astralcat {
+        long at(int x, int y) const {
+            return x + (long)y * (width + 1);
+        }
+
+    public:
+        template <typename ACCEPT>
+        IntegralImage(const mdarray_float &data, ACCEPT accept) :
+            width(data.length(0)),
+            height(data.length(1)),
+            n((size_t)(width + 1) * (height + 1), 0),
+            s(n.size(), 0.),
+            s2(n.size(), 0.)
+        {
+            // prefix sums along the rows, then down the columns
+            #pragma omp parallel for
+            for (int y = 0;  y < height;  y++) {
+                const float *row = data.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    const long i = at(x + 1, y + 1);
+                    const bool ok = accept(x, y, row[x]);
+                    n[i]  = n[i - 1]  + ok;
+                    s[i]  = s[i - 1]  + (ok ? row[x] : 0.);
+                    s2[i] = s2[i - 1] + (ok ? (double)row[x] * row[x] : 0.);
+                }
+            }
+            const int block = 64;
+            #pragma omp parallel for
+            for (int x0 = 1;  x0 <= width;  x0 += block) {
+                for (int y = 1;  y <= height;  y++) {
+                    for (int x = x0;  x < std::min(width + 1, x0 + block);  x++) {
+                        n[at(x, y)]  += n[at(x, y - 1)];
+                        s[at(x, y)]  += s[at(x, y - 1)];
+                        s2[at(x, y)] += s2[at(x, y - 1)];
+                    }
+                }
+            }
+        }
+
+        // mean and standard deviation of the accepted pixels in [x0, x1) x [y0, y1); NaN if fewer than two
+        void stats(int x0, int y0, int x1, int y1, double &mean, double &stddev) const {
+            const long a = at(x0, y0), b = at(x1, y0), c = at(x0, y1), d = at(x1, y1);
+            const double count = n[d] - n[b] - n[c] + n[a];
+            if (count < 2.) {
+                mean = stddev = NAN;
+                return;
+            }
+            mean = (s[d] - s[b] - s[c] + s[a]) / count;
+            stddev = sqrt(std::max(0., (s2[d] - s2[b] - s2[c] + s2[a]) / count - mean * mean));
+        }
+    };
+
+
+    /*
+     * local standard deviation in a binsize x binsize window around every pixel.
+     * each iteration rebuilds the tables from the pixels within clipping_sigma of the
+     * previous iteration's local mean, so the cost stays O(1) per pixel and iteration.
+     */
+    mdarray_float integral_stddev_map(const mdarray_float &surface, int binsize, double clipping_sigma, int iterations) {
+        const int width  = surface.length(0),
+                  height = surface.length(1),
+                  r = binsize / 2;
+        mdarray_float mean(false, width, height),
+                      sigma(false, width, height);
+
+        for (int i = 0;  i <= iterations;  i++) {
+            const IntegralImage table(surface, [&](int x, int y, double z) {
+                return isfinite(z) && (i == 0 || std::abs(z - mean[x + (long)y * width]) <= clipping_sigma * sigma[x + (long)y * width]);
+            });
+            #pragma omp parallel for
+            for (int y = 0;  y < height;  y++) {
+                float *m = mean.array_ptr(0, y),
+                      *sd = sigma.array_ptr(0, y);
+                for (int x = 0;  x < width;  x++) {
+                    double mu, stddev;
+                    table.stats(std::max(0, x - r), std::max(0, y - r),
+                                std::min(width, x + r + 1), std::min(height, y + r + 1), mu, stddev);
+                    m[x] = mu;
+                    sd[x] = stddev;
+                }
+            }
+        }
+
+        return sigma;
+    }
+
+
+    /*
+     * integral_stddev_map() for a stream of rows, with the local mean as well.
+     * every clipping iteration keeps running column sums over its window of 2r + 1 rows,
+     * one row in and one out, so a row costs O(width) per iteration however tall the
+     * image; iteration i takes in a row once iteration i - 1 has its statistics.
+     */
+    class StreamNoiseMap {
+        // rows [first, first + q.size()) of the image
+        struct Rows {
+            std::deque< std::vector<float> > q;
+            int first = 0;
+
+            int end() const { return first + q.size(); }
+            const std::vector<float> &operator[](int y) const { return q[y - first]; }
+            void pop() { q.pop_front(); first++; }
+        };
+
+        struct Level {
+            Rows accepted;                          // the window's rows, rejected pixels NaN
+            Rows mean, sigma;                       // not yet taken by the next level
+            std::vector<int> n;                     // column sums over accepted
+            std::vector<double> s, s2;
+        };
+
+        const int width, height, r;
+        const double clipping_sigma;
+        Rows data;
+        std::vector<Level> levels;
+
+        void add(Level &level, const std::vector<float> &row, int sign) {
+            for (int x = 0;  x < width;  x++) {
+                if (isfinite(row[x])) {
+                    level.n[x]  += sign;
+                    level.s[x]  += sign * row[x];
+                    level.s2[x] += sign * (double)row[x] * row[x];
+                }
+            }
+        }
+
+        void take(int l) {
+            Level &level = levels[l];
+            const int y = level.accepted.end();
+            std::vector<float> row = data[y];
+            if (l > 0) {
+                Rows &mean = levels[l - 1].mean,
+                     &sigma = levels[l - 1].sigma;
+                for (int x = 0;  x < width;  x++) {
+                    if (! (std::abs(row[x] - mean[y][x]) <= clipping_sigma * sigma[y][x]))
+                        row[x] = NAN;
+                }
+                mean.pop();
+                sigma.pop();
+            }
+            add(level, row, +1);
+            level.accepted.q.push_back(std::move(row));
+        }
+
+        void emit(int l) {
+            Level &level = levels[l];
+            const int y = level.mean.end();
+            while (level.accepted.first < y - r) {
+                add(level, level.accepted.q.front(), -1);
+                level.accepted.pop();
+            }
+            // the same window as IntegralImage::stats, from prefix sums of the column sums
+            std::vector<int> pn(width + 1, 0);
+            std::vector<double> ps(width + 1, 0.), ps2(width + 1, 0.);
+            for (int x = 0;  x < width;  x++) {
+                pn[x + 1]  = pn[x]  + level.n[x];
+                ps[x + 1]  = ps[x]  + level.s[x];
+                ps2[x + 1] = ps2[x] + level.s2[x];
+            }
+            std::vector<float> m(width), sd(width);
+            for (int x = 0;  x < width;  x++) {
+                const int x0 = std::max(0, x - r),
+                          x1 = std::min(width, x + r + 1);
+                const double count = pn[x1] - pn[x0];
+                if (count < 2.) {
+                    m[x] = sd[x] = NAN;
+                    continue;
+                }
+                const double mu = (ps[x1] - ps[x0]) / count;
+                m[x] = mu;
+                sd[x] = sqrt(std::max(0., (ps2[x1] - ps2[x0]) / count - mu * mu));
+            }
+            level.mean.q.push_back(std::move(m));
+            level.sigma.q.push_back(std::move(sd));
+        }
+
+    public:
+        StreamNoiseMap(int width, int height, int binsize, double clipping_sigma, int iterations) :
+            width(width),
+            height(height),
+            r(binsize / 2),
+            clipping_sigma(clipping_sigma),
+            levels(iterations + 1)
+        {
+            for (auto &level: levels) {
+                level.n.assign(width, 0);
+                level.s.assign(width, 0.);
+                level.s2.assign(width, 0.);
+            }
+        }
+
+        // the next image row
+        void push(const float *row) {
+            data.q.emplace_back(row, row + width);
+            for (int l = 0;  l < levels.size();  l++) {
+                Level &level = levels[l];
+                // a row is emitted as soon as its window is in, before any row beyond it
+                while (level.mean.end() < height) {
+                    if (level.accepted.end() >= std::min(height, level.mean.end() + r + 1))
+                        emit(l);
+                    else if (level.accepted.end() < data.end() &&
+                             (l == 0 || level.accepted.end() < levels[l - 1].mean.end()))
+                        take(l);
+                    else
+                        break;
+                }
+            }
+            while (data.first < levels.back().accepted.end())
+                data.pop();
+        }
+
+        // the local mean and stddev of the next row, once the rows it depends on are in
+        bool pop(std::vector<float> &mean, std::vector<float> &sigma) {
+            Level &last = levels.back();
+            if (last.mean.q.empty())
+                return false;
+            mean.swap(last.mean.q.front());
+            sigma.swap(last.sigma.q.front());
+            last.mean.pop();
+            last.sigma.pop();
+            return true;
+        }
+    };
+
+
+    /*
+     * single-pass labeling of a stream of rows.
+     * only the labels of the previous and the current row are kept; a component is
+     * closed, and handed to emit, as soon as a row contains none of its pixels.
+     */
+    class StreamLabeling {
+        const int width;
+        std::vector<int> prev, cur;                 // labels of the rows, -1 for background
+        std::vector<int> parent;
+        std::vector<Component> stats;               // valid for roots
 
-    std::vector<Source> detect(const char *dd_str, const mdarray_float &original) {
+        int find(int i) {
+            while (parent[i] != i)
+                i = parent[i] = parent[parent[i]];
+            return i;
+        }
+
+        int unite(int i, int j) {
+            i = find(i);
+            j = find(j);
+            if (i == j)
+                return i;
+            if (i < j)
+                std::swap(i, j);
+            parent[i] = j;
+            stats[j].merge(stats[i]);
+            return j;
+        }
+
+    public:
+        StreamLabeling(int width) : width(width), prev(width, -1), cur(width, -1) {
+        }
+
+        template <typename EMIT>
+        void push(const float *row, int y, double threshold, EMIT emit) {
+            for (int x = 0;  x < width;  x++) {
+                cur[x] = -1;
+                if (! (row[x] >= threshold))
+                    continue;
+                int l = -1;
+                auto join = [&](int n) {
+                    if (n >= 0)
+                        l = l < 0 ? find(n) : unite(l, n);
+                };
+                if (x > 0)
+                    join(cur[x - 1]);
+                for (int xx = std::max(0, x - 1);  xx <= std::min(width - 1, x + 1);  xx++)
+                    join(prev[xx]);
+                if (l < 0) {
+                    l = parent.size();
+                    parent.push_back(l);
+                    stats.push_back(Component());
+                }
+                stats[l].add(x, y, row[x]);
+                cur[x] = l;
+            }
+
+            // close the components of the previous row that did not continue
+            std::vector<char> open(parent.size(), 0);
+            for (int x = 0;  x < width;  x++) {
+                if (cur[x] >= 0)
+                    open[cur[x] = find(cur[x])] = 1;
+            }
+            for (int x = 0;  x < width;  x++) {
+                if (prev[x] >= 0 && ! open[find(prev[x])]) {
+                    open[find(prev[x])] = 1;
+                    emit(stats[find(prev[x])]);
+                }
+            }
+
+            // renumber the open components so that the tables stay O(width)
+            std::vector<int> number(parent.size(), -1);
+            std::vector<Component> next;
+            for (int x = 0;  x < width;  x++) {
+                if (cur[x] >= 0 && number[cur[x]] < 0) {
+                    number[cur[x]] = next.size();
+                    next.push_back(stats[cur[x]]);
+                }
+                prev[x] = cur[x] < 0 ? -1 : number[cur[x]];
+            }
+            stats.swap(next);
+            parent.resize(stats.size());
+            for (int i = 0;  i < parent.size();  i++)
+                parent[i] = i;
+        }
+
+        template <typename EMIT>
+        void finish(EMIT emit) {
+            for (const auto &c: stats)
+                emit(c);
+            stats.clear();
+            parent.clear();
+            std::fill(prev.begin(), prev.end(), -1);
+        }
+    };
+
+
+    StrKeyValue detect_args(const char *dd_str) {
         auto args = parse_keyvalue(dd_str);
         reverse_merge(args, {{"min_area", "5"},
                              {"detect_threshold", "2.5"},
                              {"stddev_binsize",   "50"},
                              {"kernel_size",      "0"},
                              {"min_flux",         "10."},
-                             {"gaussian_sigma",   "1.5"}});
-
+                             {"gaussian_sigma",   "1.5"},
+                             {"noise_map",        "polyfit"},
+                             {"noise_iterations", "3"},
+                             {"deblend_nthresh",  "0"},
+                             {"deblend_mincont",  "0.005"},
+                             {"deblend_min_area", ""},
+                             {"pyramid_levels",   "0"},
+                             {"pyramid_kernel_size", "2"}});
         logger.info("parameters: %s", boost::lexical_cast<string>(args));
+        return args;
+    }
+
+
+} // namespace
+
+
+namespace astralcat {
+
+    std::vector<Source> detect(const char *dd_str, const mdarray_float &original, const BitPlane *mask, BitPlane *footprints) {
+        auto args = detect_args(dd_str);
 
         const int min_area   = atoi(args["min_area"].c_str()),
                   stddev_binsize = atoi(args["stddev_binsize"].c_str()),
@@ -156,21 +971,138 @@ namespace astralcat {
         const double threshold = atof(args["detect_threshold"].c_str()),
                      min_flux  = atoi(args["min_flux"].c_str()),
                      gaussian_sigma = atof(args["gaussian_sigma"].c_str());
+        const int noise_iterations = atoi(args["noise_iterations"].c_str());
+        const Deblending deblending = {atoi(args["deblend_nthresh"].c_str()),
+                                       atof(args["deblend_mincont"].c_str()),
+                                       args["deblend_min_area"].empty() ? min_area : atoi(args["deblend_min_area"].c_str()),
+                                       threshold};
+        if (args["noise_map"] != "polyfit" && args["noise_map"] != "integral")
+            throw std::invalid_argument((boost::format("invalid noise_map: %s") % args["noise_map"]).str());
 
         mdarray_float surface = original;
+        if (mask)
+            mask->fill(surface, NAN);
 
         logger.info("estimate variance map...");
-        surface /= stddev_map(surface, stddev_binsize);
+        if (args["noise_map"] == "integral")
+            surface /= integral_stddev_map(surface, stddev_binsize, 2., noise_iterations);
+        else
+            surface /= stddev_map(surface, stddev_binsize);
+
+        const int pyramid_levels = atoi(args["pyramid_levels"].c_str());
+        mdarray_float normalised;
+        if (pyramid_levels > 0)
+            normalised = surface;
 
         if (kernel_size > 0) {
             logger.info("convoluting...");
             surface = convolve(surface, gaussian_kernel(kernel_size, gaussian_sigma), kernel_size, kernel_size);
         }
 
-        mdarray_uchar mask(false, surface.length(0), surface.length(1));
-        mark_detected(surface, mask, threshold);
+        BitPlane detected(surface.length(0), surface.length(1)),
+                 found;
+        mark_detected(surface, detected, threshold);
+
+        auto sources = pickup_connecting_pixels(surface, detected, &found, min_area, min_flux, deblending);
+        if (pyramid_levels > 0) {
+            auto extended = detect_pyramid(normalised, found, pyramid_levels, atoi(args["pyramid_kernel_size"].c_str()),
+                                           gaussian_sigma, threshold, min_area, min_flux);
+            sources.insert(sources.end(), extended.begin(), extended.end());
+        }
+        if (footprints)
+            *footprints = std::move(found);
+        return sources;
+    }
+
+
+    /*
+     * detect() for images larger than memory.
+     * the rows are read once and streamed through the integral noise map, which also
+     * gives the local clipped mean, so the input need not be sky subtracted.  The
+     * normalised surface is smoothed in bands of stddev_binsize rows with the kernel's
+     * rows of context around them.  Sources are handed to emit as soon as their
+     * components close, so memory is O(width x (noise_iterations + 1) x stddev_binsize)
+     * for any image height.
+     */
+    void detect_stream(const char *dd_str, const char *filename, const std::function<void(const Source &)> &emit) {
+        auto args = detect_args(dd_str);
+
+        const int min_area   = atoi(args["min_area"].c_str()),
+                  stddev_binsize = atoi(args["stddev_binsize"].c_str()),
+                  kernel_size = atoi(args["kernel_size"].c_str()),
+                  noise_iterations = atoi(args["noise_iterations"].c_str());
+        const double threshold = atof(args["detect_threshold"].c_str()),
+                     min_flux  = atoi(args["min_flux"].c_str()),
+                     gaussian_sigma = atof(args["gaussian_sigma"].c_str());
+        if (atoi(args["deblend_nthresh"].c_str()) > 1)
+            throw std::invalid_argument("deblending is not supported by streaming detection");
+
+        FitsRowReader reader(filename);
+        const int width  = reader.width(),
+                  height = reader.height(),
+                  band = std::max(1, stddev_binsize),
+                  context = kernel_size;
+        logger.info("streaming %s: %dx%d, %d rows at a time...", filename, width, height, band + 2 * context);
+
+        // rows [read_y - raw.size(), read_y) wait for their noise statistics
+        StreamNoiseMap noise(width, height, stddev_binsize, 2., noise_iterations);
+        std::deque< std::vector<float> > raw;
+        int read_y = 0;
+        auto normalised = [&](int rows) {
+            mdarray_float out(false, width, rows);
+            std::vector<float> mean, sigma;
+            for (int k = 0;  k < rows;  k++) {
+                while (! noise.pop(mean, sigma)) {
+                    const int n = std::min(band, height - read_y);
+                    const mdarray_float block = reader.read(read_y, n);
+                    for (int j = 0;  j < n;  j++) {
+                        const float *row = block.array_ptr(0, j);
+                        raw.emplace_back(row, row + width);
+                        noise.push(row);
+                    }
+                    read_y += n;
+                }
+                float *o = out.array_ptr(0, k);
+                for (int x = 0;  x < width;  x++)
+                    o[x] = (raw.front()[x] - mean[x]) / sigma[x];
+                raw.pop_front();
+            }
+            return out;
+        };
+
+        const mdarray_float kernel = kernel_size > 0 ? gaussian_kernel(kernel_size, gaussian_sigma) : mdarray_float();
+        StreamLabeling labeling(width);
+        long n = 0;
+        auto close = [&](const Component &c) {
+            if (c.area >= min_area && c.flux >= min_flux) {
+                emit(measure(c));
+                n++;
+            }
+        };
+
+        // window holds the normalised rows [wy0, wy1)
+        mdarray_float window;
+        int wy0 = 0, wy1 = 0;
+        for (int y0 = 0;  y0 < height;  y0 += band) {
+            const int y1 = std::min(height, y0 + band),
+                      a = std::max(0, y0 - context),
+                      b = std::min(height, y1 + context);
+            mdarray_float next(false, width, b - a);
+            if (wy1 > a)
+                next.paste(window.section(0, width, a - wy0, wy1 - a));
+            if (b > std::max(a, wy1))
+                next.paste(normalised(b - std::max(a, wy1)), 0, std::max(a, wy1) - a);
+            window.swap(next);
+            wy0 = a;
+            wy1 = b;
+
+            const mdarray_float surface = kernel_size > 0 ? convolve(window, kernel, kernel_size, kernel_size) : window;
+            for (int y = y0;  y < y1;  y++)
+                labeling.push(surface.array_ptr(0, y - wy0), y, threshold, close);
+        }
+        labeling.finish(close);
 
-        return pickup_connecting_pixels(surface, mask, min_area, min_flux);
+        logger.info("%d sources", n);
     }
 
 }
@@ -2,6 +2,7 @@
 #define _ASTRALCAT_MDARRAY_INTERPOLATE_
 
 
+#include <cmath>
 #include "sfitsio.h"
 
 
@@ -31,11 +32,12 @@ namespace astralcat { namespace mdarray_wrapper {
              *   +------+-+
              * (u,v)
              */
-            int ui = (int)u,
-                vi = (int)v;
+            int ui = (int)floor(u),
+                vi = (int)floor(v);
             double fu = u - ui,
                    fv = v - vi;
-            return 0.5 * ((2. - fu - fv) * (*this)(u, v) + fu * (*this)(u + 1, v) + + fv * (*this)(u, v + 1));
+            return (1. - fv) * ((1. - fu) * (*this)(ui, vi    ) + fu * (*this)(ui + 1, vi    )) +
+                         fv  * ((1. - fu) * (*this)(ui, vi + 1) + fu * (*this)(ui + 1, vi + 1));
         }
     };
 
@@ -49,4 +51,65 @@ namespace astralcat { namespace mdarray_wrapper {
 } }
 
 
+namespace astralcat { namespace kernel {
+
+    /*
+     * resampling kernels.
+     * weight(r) is the 1-d profile at an offset of r pixels and vanishes for |r| >= radius.
+     * the resampler is instantiated once per kernel, so weight() inlines into its loops.
+     */
+
+    struct Nearest {
+        static const int radius = 1;
+        static double weight(double r) {
+            return std::abs(r) <= 0.5 ? 1. : 0.;
+        }
+    };
+
+
+    struct Bilinear {
+        static const int radius = 1;
+        static double weight(double r) {
+            r = std::abs(r);
+            return r < 1. ? 1. - r : 0.;
+        }
+    };
+
+
+    // Keys (1981), a = -1/2
+    struct Bicubic {
+        static const int radius = 2;
+        static double weight(double r) {
+            const double a = -0.5;
+            r = std::abs(r);
+            if (r < 1.)
+                return ((a + 2.) * r - (a + 3.)) * r * r + 1.;
+            else if (r < 2.)
+                return ((a * r - 5. * a) * r + 8. * a) * r - 4. * a;
+            else
+                return 0.;
+        }
+    };
+
+
+    template <int N>
+    struct Lanczos {
+        static const int radius = N;
+        static double sinc(double x) {
+            return sin(M_PI*x) / (M_PI * x);
+        }
+        static double weight(double r) {
+            r = std::abs(r);
+            if (r == 0.)
+                return 1.;
+            else if (r >= N)
+                return 0.;
+            else
+                return sinc(r) * sinc(r / N);
+        }
+    };
+
+} }
+
+
 #endif
@@ -0,0 +1,161 @@
+// per-cell statistics on a coarse grid, for the sky and noise estimators to interpolate.
+#include "astralcat.h"
+#include <algorithm>
+#include <stdexcept>
+#include <sli/mdarray_statistics.h>
+#include <boost/format.hpp>
+#include <boost/numeric/ublas/exception.hpp>
+
+
+using namespace sli;
+using namespace astralcat;
+using std::string;
+
+
+namespace {
+
+    std::vector<float> finite_values(const mdarray_float &cell) {
+        std::vector<float> v;
+        v.reserve(cell.length());
+        for (int i = 0;  i < cell.length();  i++) {
+            if (isfinite(cell[i]))
+                v.push_back(cell[i]);
+        }
+        return v;
+    }
+
+
+    float median(std::vector<float> &v) {
+        std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+        return v[v.size() / 2];
+    }
+
+
+    // keeps the values within clipping_sigma of the median, until none is dropped; returns the mean and stddev
+    void sigma_clip(std::vector<float> &v, double clipping_sigma, double &mean, double &stddev) {
+        for (int iter = 0;  iter < 10;  iter++) {
+            double s = 0., s2 = 0.;
+            for (float z: v) {
+                s += z;
+                s2 += (double)z * z;
+            }
+            mean = s / v.size();
+            stddev = sqrt(std::max(0., s2 / v.size() - mean * mean));
+            const double center = median(v);
+            const auto end = std::remove_if(v.begin(), v.end(), [&](float z) { return fabs(z - center) > clipping_sigma * stddev; });
+            if (end == v.end() || end == v.begin())
+                break;
+            v.erase(end, v.end());
+        }
+    }
+
+
+    double clipped_mean(mdarray_float &cell, double clipping_sigma) {
+        auto v = finite_values(cell);
+        if (v.size() < 0.25 * cell.length())
+            return NAN;
+        double mean, stddev;
+        sigma_clip(v, clipping_sigma, mean, stddev);
+        return mean;
+    }
+
+
+    double median_of(mdarray_float &cell, double) {
+        auto v = finite_values(cell);
+        if (v.size() < 0.25 * cell.length())
+            return NAN;
+        return median(v);
+    }
+
+
+    // 2.5 median - 1.5 mean of the clipped values, or the median if they are too skewed (as SExtractor)
+    double mode(mdarray_float &cell, double clipping_sigma) {
+        auto v = finite_values(cell);
+        if (v.size() < 0.25 * cell.length())
+            return NAN;
+        double mean, stddev;
+        sigma_clip(v, clipping_sigma, mean, stddev);
+        const double med = median(v);
+        return fabs(mean - med) < 0.3 * stddev ? 2.5 * med - 1.5 * mean : med;
+    }
+
+
+    // the centre of a clipped 3rd order polynomial
+    double polynomial(mdarray_float &cell, double clipping_sigma) try {
+        auto fitter = PolynomialFitter2D::iterative_fit(cell, 3, clipping_sigma);
+        if ((double)valid_count(cell) / cell.length() < 0.25) {
+            return NAN;
+        }
+        return fitter->at(cell.length(0) / 2., cell.length(1) / 2.);
+    }
+    catch (const boost::numeric::ublas::singular &e) {
+        return NAN;
+    }
+    catch (const std::exception &e) {
+        logger.warn("failed to estimate local sky: %e", e.what());
+        return NAN;
+    }
+
+
+    // the stddev about a clipped 2nd order polynomial
+    double poly_stddev(mdarray_float &cell, double clipping_sigma) try {
+        const int width  = cell.length(0),
+                  height = cell.length(1);
+        auto fitter = PolynomialFitter2D::iterative_fit(cell, 2, clipping_sigma);
+        if ((double)valid_count(cell) / cell.length() <= 0.5) {
+            return NAN;
+        }
+        return md_stddev(cell - fitter->surface(0, width, 0, height, width, height));
+    }
+    catch (const boost::numeric::ublas::singular &e) {
+        return NAN;
+    }
+
+}
+
+
+namespace astralcat {
+
+    MeshStatistic mesh_statistic(const char *name, double clipping_sigma) {
+        double (*f)(mdarray_float &, double);
+        const string s = name;
+        if (s == "clipped_mean")
+            f = clipped_mean;
+        else if (s == "median")
+            f = median_of;
+        else if (s == "mode")
+            f = mode;
+        else if (s == "polynomial")
+            f = polynomial;
+        else if (s == "poly_stddev")
+            f = poly_stddev;
+        else
+            throw std::invalid_argument((boost::format("invalid mesh statistic: %s") % name).str());
+        return [=](mdarray_float &cell) { return f(cell, clipping_sigma); };
+    }
+
+
+    /*
+     * cells are binsize square from the origin, the last row and column clipped by the
+     * frame (and empty, so NaN, when binsize divides it).  The cells are shared out
+     * dynamically, as the statistic costs less on cells that are mostly NaN.
+     */
+    mdarray_float mesh(const mdarray_float &data, int binsize, const MeshStatistic &statistic) {
+        const int gnx = data.length(0) / binsize + 1,
+                  gny = data.length(1) / binsize + 1;
+
+        mdarray_float grid(false, gnx, gny);
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0;  i < gnx * gny;  i++) {
+            const int gx = i % gnx,
+                      gy = i / gnx;
+            mdarray_float cell;
+            cell = data.section(gx * binsize, binsize, gy * binsize, binsize);
+            grid(gx, gy) = cell.length() > 0 ? statistic(cell) : NAN;
+        }
+
+        return grid;
+    }
+
+}
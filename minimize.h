@@ -2,6 +2,7 @@
 #define _MICHI_MINIMIZE_
 
 #include <gsl/gsl_multimin.h>
+#include <gsl/gsl_multifit_nlinear.h>
 #include <stdio.h>
 #include <vector>
 #include <stdexcept>
@@ -85,6 +86,82 @@ namespace astralcat {
         }
 
     } // namespace simplex
+
+
+    namespace nlinear {
+
+        /*
+         * nonlinear least squares by GSL's trust region solver (Levenberg-Marquardt).
+         * residual(x, f) fills the n residuals of the parameters x[p];
+         * jacobian(x, J, tda) fills df_i/dx_j at J[i * tda + j].
+         * x holds the starting point and receives the solution.
+         */
+        template <typename RESIDUAL, typename JACOBIAN>
+        void minimize(
+            const RESIDUAL& residual,
+            const JACOBIAN& jacobian,
+            std::vector<double>& x,
+            int n,
+            int max_iter = 100,
+            double xtol = 1.e-8,
+            double gtol = 1.e-8
+        ) {
+            struct Context {
+                const RESIDUAL& residual;
+                const JACOBIAN& jacobian;
+                std::vector<double> x;
+                const double* get(const gsl_vector* v) {
+                    for (int i = 0;  i < x.size();  i++) x[i] = gsl_vector_get(v, i);
+                    return &x[0];
+                }
+                static int f_for_gsl(const gsl_vector* v, void* params, gsl_vector* f) {
+                    Context* self = (Context*)params;
+                    // the solver's own vectors are contiguous
+                    self->residual(self->get(v), f->data);
+                    return GSL_SUCCESS;
+                }
+                static int df_for_gsl(const gsl_vector* v, void* params, gsl_matrix* J) {
+                    Context* self = (Context*)params;
+                    self->jacobian(self->get(v), J->data, J->tda);
+                    return GSL_SUCCESS;
+                }
+                Context(const RESIDUAL& residual, const JACOBIAN& jacobian, int p) : residual(residual), jacobian(jacobian), x(p) {}
+            };
+
+            const int p = x.size();
+            if (n < p)
+                throw std::invalid_argument("fewer residuals than parameters");
+
+            Context context(residual, jacobian, p);
+
+            gsl_multifit_nlinear_fdf fdf;
+            fdf.f = Context::f_for_gsl;
+            fdf.df = Context::df_for_gsl;
+            fdf.fvv = NULL;
+            fdf.n = n;
+            fdf.p = p;
+            fdf.params = &context;
+
+            gsl_multifit_nlinear_parameters params = gsl_multifit_nlinear_default_parameters();
+            gsl_multifit_nlinear_workspace* solver = gsl_multifit_nlinear_alloc(gsl_multifit_nlinear_trust, &params, n, p);
+
+            gsl_vector_view initial = gsl_vector_view_array(&x[0], p);
+            gsl_multifit_nlinear_init(&initial.vector, &fdf, solver);
+
+            int info;
+            int status = gsl_multifit_nlinear_driver(max_iter, xtol, gtol, 0., NULL, NULL, &info, solver);
+            if (status == GSL_SUCCESS) {
+                const gsl_vector* result = gsl_multifit_nlinear_position(solver);
+                for (int i = 0;  i < p;  i++) x[i] = gsl_vector_get(result, i);
+            }
+
+            gsl_multifit_nlinear_free(solver);
+
+            if (status != GSL_SUCCESS)
+                throw std::runtime_error(gsl_strerror(status));
+        }
+
+    } // namespace nlinear
 } // namespace astralcat
 
 
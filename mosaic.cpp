@@ -187,6 +187,29 @@ namespace astralcat {
         return new_ref;
     }
 
+
+    // fits the inverse of warper on a grid over [min_x, max_x] x [min_y, max_y]
+    Warper inverse(const Warper &warper, double min_x, double max_x, double min_y, double max_y) {
+        const int nx = 100,
+                  ny = 100;
+        auto fitter_x = PolynomialFitter2D::initialize(warper.order()),
+             fitter_y = PolynomialFitter2D::initialize(warper.order());
+        for (int iy = 0;  iy <= ny;  iy++) {
+            double r = (double)iy / ny,
+                   y = r*max_y + (1.-r)*min_y;
+            for (int ix = 0;  ix <= nx;  ix++) {
+                double r = (double)ix / nx,
+                       x = r*max_x + (1.-r)*min_x;
+                vec2 w = warper.apply({x, y});
+                fitter_x->add(w[0], w[1], x);
+                fitter_y->add(w[0], w[1], y);
+            }
+        }
+        fitter_x->fit();
+        fitter_y->fit();
+        return Warper(fitter_x->getCoeff(), fitter_y->getCoeff());
+    }
+
 }
 
 
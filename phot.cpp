@@ -0,0 +1,83 @@
+#include "astralcat.h"
+#include <getopt.h>
+#include <fstream>
+
+
+using namespace astralcat;
+
+
+int main(int argc, char *argv[]) try {
+    const char *output_file = NULL,
+               *ref_file = NULL,
+               *phot_desc = "";
+
+    int fitting_order = 3;
+
+    int opt;
+    option long_options[] = {
+        {"out",      required_argument, NULL, 'o'},
+        {"order",    required_argument, NULL, 'n'},
+        {"ref",      required_argument, NULL, 'r'},
+        {"phot",     required_argument, NULL, 'p'},
+        {NULL,       0,                 NULL, 0}
+    };
+    while ((opt = getopt_long(argc, argv, "o:n:r:p:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                output_file = optarg;
+                break;
+            case 'n':
+                fitting_order = atoi(optarg);
+                break;
+            case 'r':
+                ref_file = optarg;
+                break;
+            case 'p':
+                phot_desc = optarg;
+                break;
+            default:
+                goto argument_error;
+        }
+    }
+    if (output_file == NULL || optind == argc || (argc - optind) % 2 != 0) {
+        argument_error:
+            fprintf(stderr, "usage: %s -o OUT [-r REF] [-n ORDER] [--phot=PHOT] CAT1 CAT2...CATN IMG1 IMG2...IMGN\n", argv[0]);
+            return 1;
+    }
+    int n_input = (argc - optind) / 2;
+    char **cat_files = argv + optind,
+         **img_files = argv + optind + n_input;
+
+    // the positions are those of the reference catalog; each frame only needs its warper
+    Photometer photometer(phot_desc);
+    const auto ref = load_sources(ref_file ? : cat_files[0]);
+    Warper warper(fitting_order);
+    for (int i = 0;  i < n_input;  i++) {
+        auto log_indent = logger.info("matching %s...", cat_files[i]).indent();
+        warper.fit(ref, load_sources(cat_files[i]));
+        photometer.add(warper, img_files[i]);
+    }
+
+    const auto result = photometer.measure(ref);
+
+    std::ofstream os(output_file);
+    os << "# frame source x y sky sky_stddev";
+    for (double r: photometer.radii())
+        os << " flux_" << r;
+    os << std::endl;
+    for (int z = 0;  z < result.size();  z++) {
+        for (int i = 0;  i < ref.size();  i++) {
+            const Photometry &p = result[z][i];
+            os << boost::format("%d %d % e % e % e % e") % z % i % ref[i][0] % ref[i][1] % p.sky % p.sky_stddev;
+            for (double f: p.flux)
+                os << boost::format(" % e") % f;
+            os << std::endl;
+        }
+    }
+
+    return 0;
+}
+catch (const std::exception &e) {
+    logger.fatal("fatal error: %s", e.what());
+    return 1;
+}
@@ -0,0 +1,279 @@
+// forced aperture photometry of a reference catalog on many frames.
+#include "astralcat.h"
+#include <algorithm>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/progress.hpp>
+
+
+using namespace sli;
+using namespace astralcat;
+using std::string;
+
+
+namespace {
+
+    // 0.5 * (x sqrt(r^2 - x^2) + r^2 asin(x / r)), the integral of sqrt(r^2 - x^2)
+    double half_disk_primitive(double r, double x) {
+        return 0.5 * (x * sqrt(std::max(0., r*r - x*x)) + r*r * asin(std::max(-1., std::min(1., x / r))));
+    }
+
+
+    /*
+     * exact area of the disk of radius r around the origin within [x0, x1] x [y0, y1].
+     * between the breakpoints where the circle crosses y0 or y1, both bounds of the
+     * integrand are either a rectangle edge or the circle, so each piece is closed form.
+     */
+    double disk_rect_area(double r, double x0, double x1, double y0, double y1) {
+        x0 = std::max(x0, -r);
+        x1 = std::min(x1,  r);
+        if (x0 >= x1 || y0 >= y1)
+            return 0.;
+        std::vector<double> xs = {x0, x1};
+        for (double y: {y0, y1}) {
+            if (std::abs(y) < r) {
+                const double b = sqrt(r*r - y*y);
+                for (double x: {-b, b}) {
+                    if (x0 < x && x < x1)
+                        xs.push_back(x);
+                }
+            }
+        }
+        std::sort(xs.begin(), xs.end());
+
+        double area = 0.;
+        for (int i = 0;  i + 1 < xs.size();  i++) {
+            const double a = xs[i],
+                         b = xs[i + 1],
+                         m = 0.5 * (a + b),
+                         s = sqrt(std::max(0., r*r - m*m));
+            if (std::min(y1, s) <= std::max(y0, -s))
+                continue;
+            const double arc = half_disk_primitive(r, b) - half_disk_primitive(r, a),
+                         upper = y1 < s  ? y1 * (b - a) : arc,
+                         lower = y0 > -s ? y0 * (b - a) : -arc;
+            area += upper - lower;
+        }
+        return area;
+    }
+
+
+    /*
+     * pixel weights of a circular aperture, one table per sub-pixel phase of the centre.
+     * a centre at (ui + i / phases, vi + j / phases) uses table (i, j), whose pixel (dx, dy)
+     * is image pixel (ui + dx - half, vi + dy - half) weighted by its exact overlap.
+     */
+    class Aperture {
+    public:
+        static const int phases = 16;
+        const double radius;
+        const int half, size;
+        std::vector<float> weights;
+
+        Aperture(double radius) :
+            radius(radius),
+            half((int)ceil(radius) + 1),
+            size(2 * half + 1),
+            weights((size_t)phases * phases * size * size)
+        {
+            for (int j = 0;  j < phases;  j++)  for (int i = 0;  i < phases;  i++) {
+                const double fu = (double)i / phases,
+                             fv = (double)j / phases;
+                float *w = table(i, j);
+                for (int dy = 0;  dy < size;  dy++)  for (int dx = 0;  dx < size;  dx++) {
+                    // pixel centres are at integer coordinates
+                    const double x = dx - half - fu,
+                                 y = dy - half - fv;
+                    w[dx + dy * size] = disk_rect_area(radius, x - 0.5, x + 0.5, y - 0.5, y + 0.5);
+                }
+            }
+        }
+
+        const float *table(int i, int j) const {
+            return &weights[(size_t)(i + j * phases) * size * size];
+        }
+
+        float *table(int i, int j) {
+            return &weights[(size_t)(i + j * phases) * size * size];
+        }
+    };
+
+
+    struct Frame {
+        string filename;
+        Warper forward_warper;
+    };
+
+}
+
+
+struct astralcat::Photometer::Impl {
+    std::vector<double> radii;
+    std::vector<Aperture> apertures;
+    double annulus_inner, annulus_outer, clipping_sigma;
+    std::vector<Frame> frames;
+
+
+    Impl(StrKeyValue args) {
+        reverse_merge(args, {{"radii",          "3,5,8"},
+                             {"annulus_inner",  "12"},
+                             {"annulus_outer",  "18"},
+                             {"clipping_sigma", "3.0"}});
+        logger.info("Photometer: %s", boost::lexical_cast<string>(args));
+        for (const auto &r: split(args["radii"].c_str(), ","))
+            radii.push_back(atof(r.c_str()));
+        annulus_inner = atof(args["annulus_inner"].c_str());
+        annulus_outer = atof(args["annulus_outer"].c_str());
+        clipping_sigma = atof(args["clipping_sigma"].c_str());
+        if (radii.empty() || ! (annulus_inner < annulus_outer))
+            throw std::invalid_argument((boost::format("invalid apertures: radii=%s annulus=%s..%s") % args["radii"] % args["annulus_inner"] % args["annulus_outer"]).str());
+        for (double r: radii)
+            apertures.emplace_back(r);
+    }
+
+
+    void add(const Warper &f_warper, const char *filename) {
+        frames.push_back({filename, f_warper});
+    }
+
+
+    /*
+     * frames are read and measured in parallel; each thread holds one decoded frame,
+     * divided by its EXPTIME (a stack, which has none, is measured as it is).
+     * the catalog is in reference coordinates and goes through the inverse warper of
+     * every frame.
+     */
+    std::vector< std::vector<Photometry> > measure(const std::vector<Source> &catalog) {
+        auto log_indent = logger.info("forced photometry: %d sources x %d frames...", catalog.size(), frames.size()).indent();
+        std::vector< std::vector<Photometry> > result(frames.size());
+
+        boost::progress_display progress(frames.size(), std::cerr);
+        #pragma omp parallel for schedule(dynamic)
+        for (int z = 0;  z < frames.size();  z++) {
+            fitscc fits;
+            fits.read_stream(frames[z].filename.c_str());
+            auto &hdu = fits.image(0L);
+            hdu.convert_type(FITS::FLOAT_T);
+            mdarray_float &data = hdu.float_array();
+            // per second, so that frames of different exposures compare
+            const long k = hdu.header_index("EXPTIME");
+            const double exptime = k < 0 ? NAN : hdu.header(k).dvalue();
+            if (exptime > 0.) {
+                data *= 1. / exptime;
+            }
+            else {
+                #pragma omp critical
+                logger.warn("%s: no EXPTIME, measured as it is", frames[z].filename);
+            }
+            const Warper i_warper = inverse(frames[z].forward_warper, 0, data.length(0), 0, data.length(1));
+
+            std::vector<Photometry> &r = result[z];
+            r.reserve(catalog.size());
+            for (const auto &s: catalog)
+                r.push_back(measure_one(data, i_warper.apply(s)));
+
+            #pragma omp critical
+            ++progress;
+        }
+        return result;
+    }
+
+
+    Photometry measure_one(const mdarray_float &data, const vec2 &uv) const {
+        const int width  = data.length(0),
+                  height = data.length(1);
+        Photometry p;
+
+        // sky: clipped mean of the whole pixels whose centres lie in the annulus
+        std::vector<float> annulus;
+        const int ro = (int)ceil(annulus_outer);
+        for (int y = (int)round(uv[1]) - ro;  y <= (int)round(uv[1]) + ro;  y++) {
+            if (y < 0 || y >= height)
+                continue;
+            const float *row = data.array_ptr(0, y);
+            for (int x = (int)round(uv[0]) - ro;  x <= (int)round(uv[0]) + ro;  x++) {
+                const double r2 = (x - uv[0]) * (x - uv[0]) + (y - uv[1]) * (y - uv[1]);
+                if (x >= 0 && x < width && annulus_inner * annulus_inner <= r2 && r2 < annulus_outer * annulus_outer && isfinite(row[x]))
+                    annulus.push_back(row[x]);
+            }
+        }
+        p.sky = p.sky_stddev = NAN;
+        if (annulus.size() >= 3) {
+            std::nth_element(annulus.begin(), annulus.begin() + annulus.size() / 2, annulus.end());
+            double center = annulus[annulus.size() / 2],
+                   stddev = INFINITY;
+            for (int i = 0;  i < 3;  i++) {
+                double n = 0., s = 0., s2 = 0.;
+                for (float z: annulus) {
+                    if (std::abs(z - center) <= clipping_sigma * stddev) {
+                        n += 1.;
+                        s += z;
+                        s2 += (double)z * z;
+                    }
+                }
+                if (n < 2.)
+                    break;
+                center = s / n;
+                stddev = sqrt(std::max(0., s2 / n - center * center));
+            }
+            p.sky = center;
+            p.sky_stddev = stddev;
+        }
+
+        // apertures: the table of the nearest sub-pixel phase
+        int ui = (int)floor(uv[0]),
+            vi = (int)floor(uv[1]),
+            i = (int)round((uv[0] - ui) * Aperture::phases),
+            j = (int)round((uv[1] - vi) * Aperture::phases);
+        if (i == Aperture::phases) {
+            i = 0;
+            ui++;
+        }
+        if (j == Aperture::phases) {
+            j = 0;
+            vi++;
+        }
+        for (const auto &a: apertures) {
+            const float *w = a.table(i, j);
+            double flux = 0.,
+                   area = 0.;
+            for (int dy = 0;  dy < a.size;  dy++) {
+                const int y = vi + dy - a.half;
+                for (int dx = 0;  dx < a.size;  dx++) {
+                    const int x = ui + dx - a.half;
+                    const float k = w[dx + dy * a.size];
+                    if (k == 0.f)
+                        continue;
+                    const float z = x >= 0 && x < width && y >= 0 && y < height ? data.array_ptr(0, y)[x] : NAN;
+                    flux += k * z;
+                    area += k;
+                }
+            }
+            p.flux.push_back(flux - area * p.sky);
+        }
+        return p;
+    }
+};
+
+
+namespace astralcat {
+
+    Photometer::Photometer(const char *phot_desc) :
+        pimpl(new Photometer::Impl(parse_keyvalue(phot_desc)))
+    {
+    }
+
+    void Photometer::add(const Warper &forward_warper, const char *filename) {
+        pimpl->add(forward_warper, filename);
+    }
+
+    const std::vector<double> &Photometer::radii() const {
+        return pimpl->radii;
+    }
+
+    std::vector< std::vector<Photometry> > Photometer::measure(const std::vector<Source> &catalog) {
+        return pimpl->measure(catalog);
+    }
+
+}
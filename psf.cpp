@@ -0,0 +1,245 @@
+// PSF fitting of detected sources for positions better than the first moments.
+#include "astralcat.h"
+#include "minimize.h"
+#include <algorithm>
+#include <stdexcept>
+#include <gsl/gsl_errno.h>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+using namespace sli;
+using namespace astralcat;
+using std::string;
+
+
+namespace {
+
+    /*
+     * I(x, y) = sky + flux * norm * g(r2), r2 = cxx dx^2 + cyy dy^2 + 2 cxy dx dy.
+     * gaussian: g = exp(-r2 / 2),   norm = sqrt(det) / 2 pi
+     * moffat:   g = (1 + r2)^-beta, norm = (beta - 1) sqrt(det) / pi
+     * with det = cxx cyy - cxy^2, so that flux is the total flux of the profile.
+     */
+    enum { X0, Y0, FLUX, SKY, CXX, CYY, CXY, N_PARAMS };
+
+    struct Profile {
+        bool moffat;
+        double beta;
+
+        double norm(double det) const {
+            return moffat ? (beta - 1.) * sqrt(det) / M_PI : sqrt(det) / (2. * M_PI);
+        }
+        // g and dg/dr2
+        void eval(double r2, double &g, double &dg) const {
+            if (moffat) {
+                g = pow(1. + r2, -beta);
+                dg = -beta * g / (1. + r2);
+            }
+            else {
+                g = exp(-0.5 * r2);
+                dg = -0.5 * g;
+            }
+        }
+        // sigma of the gaussian with the same FWHM as the profile of cxx = 1
+        double sigma_scale() const {
+            return moffat ? sqrt(pow(2., 1. / beta) - 1.) / sqrt(2. * log(2.)) : 1.;
+        }
+    };
+
+
+    struct Pixel {
+        double x, y, z;
+    };
+
+
+    // second moments from the inverse covariance (cxx, cyy, cxy), scaled to gaussian sigma
+    void shape(Source &s, double cxx, double cyy, double cxy, double scale) {
+        const double det = cxx * cyy - cxy * cxy,
+                     xx = cyy / det * (scale * scale),
+                     yy = cxx / det * (scale * scale),
+                     xy = -cxy / det * (scale * scale),
+                     h = 0.5 * (xx + yy),
+                     r = sqrt(0.25 * (xx - yy) * (xx - yy) + xy * xy);
+        s.a = sqrt(std::max(0., h + r));
+        s.b = sqrt(std::max(0., h - r));
+        s.theta = 0.5 * atan2(2. * xy, xx - yy);
+        s.ellipticity = s.a > 0. ? 1. - s.b / s.a : 0.;
+    }
+
+
+    // returns false and leaves s as it was if the fit fails or runs off the box
+    bool fit_one(const mdarray_float &data, const Profile &profile, int radius, int max_iter, Source &s) {
+        const int width  = data.length(0),
+                  height = data.length(1),
+                  cx = lround(s[0]),
+                  cy = lround(s[1]);
+
+        std::vector<Pixel> pixels;
+        for (int y = std::max(0, cy - radius);  y <= std::min(height - 1, cy + radius);  y++) {
+            for (int x = std::max(0, cx - radius);  x <= std::min(width - 1, cx + radius);  x++) {
+                const double z = data(x, y);
+                if (isfinite(z))
+                    pixels.push_back({(double)x, (double)y, z});
+            }
+        }
+        if (pixels.size() < 2 * N_PARAMS)
+            return false;
+
+        /*
+         * the warm start: detect()'s centre, the box edge for the sky, and the flux and
+         * second moments of the sky subtracted pixels.  detect() measures on the smoothed
+         * S/N surface, so its flux and a, b are on another scale than the data.
+         */
+        std::vector<double> edge;
+        for (const auto &p: pixels) {
+            if (std::abs(p.x - cx) == radius || std::abs(p.y - cy) == radius)
+                edge.push_back(p.z);
+        }
+        double sky0 = 0.;
+        if (! edge.empty()) {
+            std::nth_element(edge.begin(), edge.begin() + edge.size() / 2, edge.end());
+            sky0 = edge[edge.size() / 2];
+        }
+        double sum = 0., sx = 0., sy = 0., sxx = 0., syy = 0., sxy = 0.;
+        for (const auto &p: pixels) {
+            const double w = std::max(0., p.z - sky0),
+                         dx = p.x - s[0],
+                         dy = p.y - s[1];
+            sum += w;
+            sx += w * dx;
+            sy += w * dy;
+            sxx += w * dx * dx;
+            syy += w * dy * dy;
+            sxy += w * dx * dy;
+        }
+        double xx = 1., yy = 1., xy = 0.;
+        if (sum > 0.) {
+            const double mx = sx / sum,
+                         my = sy / sum;
+            xx = std::max(sxx / sum - mx * mx, 0.25);
+            yy = std::max(syy / sum - my * my, 0.25);
+            xy = sxy / sum - mx * my;
+            if (! (xx * yy - xy * xy > 0.0625))
+                xy = 0.;
+        }
+        const double det = xx * yy - xy * xy,
+                     k = profile.sigma_scale() * profile.sigma_scale();
+        std::vector<double> q(N_PARAMS);
+        q[X0] = s[0];
+        q[Y0] = s[1];
+        q[SKY] = sky0;
+        q[CXX] = k * yy / det;
+        q[CYY] = k * xx / det;
+        q[CXY] = -k * xy / det;
+        q[FLUX] = 0.;
+        for (const auto &p: pixels)
+            q[FLUX] += p.z - sky0;
+        if (! (q[FLUX] > 0.))
+            q[FLUX] = sum > 0. ? sum : 1.;
+
+        auto residual = [&](const double *q, double *f) {
+            const double norm = profile.norm(q[CXX] * q[CYY] - q[CXY] * q[CXY]);
+            for (int i = 0;  i < pixels.size();  i++) {
+                const double dx = pixels[i].x - q[X0],
+                             dy = pixels[i].y - q[Y0],
+                             r2 = q[CXX] * dx * dx + q[CYY] * dy * dy + 2. * q[CXY] * dx * dy;
+                double g, dg;
+                profile.eval(r2, g, dg);
+                f[i] = q[SKY] + q[FLUX] * norm * g - pixels[i].z;
+            }
+        };
+
+        auto jacobian = [&](const double *q, double *J, size_t tda) {
+            const double det = q[CXX] * q[CYY] - q[CXY] * q[CXY],
+                         norm = profile.norm(det);
+            for (int i = 0;  i < pixels.size();  i++) {
+                const double dx = pixels[i].x - q[X0],
+                             dy = pixels[i].y - q[Y0],
+                             r2 = q[CXX] * dx * dx + q[CYY] * dy * dy + 2. * q[CXY] * dx * dy;
+                double g, dg;
+                profile.eval(r2, g, dg);
+                const double fn = q[FLUX] * norm,
+                             fg = q[FLUX] * norm * g / (2. * det);   // d(norm)/d(det) = norm / 2 det
+                double *row = J + i * tda;
+                row[X0]   = -2. * fn * dg * (q[CXX] * dx + q[CXY] * dy);
+                row[Y0]   = -2. * fn * dg * (q[CYY] * dy + q[CXY] * dx);
+                row[FLUX] = norm * g;
+                row[SKY]  = 1.;
+                row[CXX]  = fg * q[CYY] + fn * dg * dx * dx;
+                row[CYY]  = fg * q[CXX] + fn * dg * dy * dy;
+                row[CXY]  = -2. * fg * q[CXY] + 2. * fn * dg * dx * dy;
+            }
+        };
+
+        try {
+            nlinear::minimize(residual, jacobian, q, pixels.size(), max_iter);
+        }
+        catch (const std::exception &e) {
+            return false;
+        }
+
+        if (! (q[FLUX] > 0. && q[CXX] > 0. && q[CYY] > 0. && q[CXX] * q[CYY] > q[CXY] * q[CXY]) ||
+            std::abs(q[X0] - cx) > radius || std::abs(q[Y0] - cy) > radius)
+            return false;
+
+        // the flux stays detect()'s, so that fitted and unfitted sources share one scale
+        s[0] = q[X0];
+        s[1] = q[Y0];
+        shape(s, q[CXX], q[CYY], q[CXY], profile.sigma_scale());
+        return true;
+    }
+
+}
+
+
+namespace astralcat {
+
+    /*
+     * refines the positions and shapes of sources by least squares fits of a gaussian or
+     * moffat profile, with the centre, flux, local sky and shape free, in a
+     * (2 radius + 1)^2 box.  The solver starts from detect()'s centre and the moments of
+     * the data in the box and uses the analytic jacobian, so a source takes a handful of
+     * iterations.  Every source keeps detect()'s flux, which stitch and phot rank and
+     * weigh matches by, so the catalog has one flux scale whether or not its fits
+     * succeed.  Sources whose fit fails keep detect()'s position and shape, whose a and b
+     * are moments of the smoothed S/N surface rather than of the data.
+     */
+    std::vector<Source> fit_psf(const char *psf_desc, const mdarray_float &data, const std::vector<Source> &sources) {
+        auto args = parse_keyvalue(psf_desc);
+        reverse_merge(args, {{"profile",     "gaussian"},
+                             {"moffat_beta", "2.5"},
+                             {"radius",      "5"},
+                             {"max_iter",    "50"}});
+        logger.info("parameters: %s", boost::lexical_cast<string>(args));
+
+        Profile profile;
+        if (args["profile"] == "gaussian")
+            profile.moffat = false;
+        else if (args["profile"] == "moffat")
+            profile.moffat = true;
+        else
+            throw std::invalid_argument((boost::format("invalid profile: %s") % args["profile"]).str());
+        profile.beta = atof(args["moffat_beta"].c_str());
+        if (profile.moffat && ! (profile.beta > 1.))
+            throw std::invalid_argument((boost::format("invalid moffat_beta: %s") % args["moffat_beta"]).str());
+
+        const int radius = atoi(args["radius"].c_str()),
+                  max_iter = atoi(args["max_iter"].c_str());
+
+        // failures are reported by status, not by aborting
+        gsl_set_error_handler_off();
+
+        std::vector<Source> fitted = sources;
+        int failed = 0;
+        #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+        for (int i = 0;  i < fitted.size();  i++) {
+            if (! fit_one(data, profile, radius, max_iter, fitted[i]))
+                failed++;
+        }
+        logger.info("%d sources fitted, %d kept the position and shape of detection", fitted.size() - failed, failed);
+
+        return fitted;
+    }
+
+}
@@ -13,8 +13,12 @@ int main(int argc, char *argv[]) try {
                *mask_file = NULL,
                *catalog_file = NULL,
                *detect_desc = NULL,
-               *skyest_desc = NULL;
-    bool crop = false;
+               *skyest_desc = NULL,
+               *cosmicray_desc = NULL,
+               *psf_desc = NULL;
+    bool crop = false,
+         stream = false;
+    int source_mask_radius = -1;
 
     int opt;
     option long_options[] = {
@@ -24,9 +28,13 @@ int main(int argc, char *argv[]) try {
         {"detect",   required_argument, NULL, 'd'},
         {"crop",     no_argument,       NULL, 'C'},
         {"mask",     required_argument, NULL, 'm'},
+        {"stream",   no_argument,       NULL, 'S'},
+        {"cosmicray", required_argument, NULL, 'r'},
+        {"mask-sources", required_argument, NULL, 'M'},
+        {"psf",      required_argument, NULL, 'p'},
         {NULL,       0,                 NULL, 0}
     };
-    while ((opt = getopt_long(argc, argv, "o:m:d:c:s:C", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "o:m:d:c:s:CSr:M:p:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'o':
                 output_file = optarg;
@@ -46,17 +54,41 @@ int main(int argc, char *argv[]) try {
             case 'C':
                 crop = true;
                 break;
+            case 'S':
+                stream = true;
+                break;
+            case 'r':
+                cosmicray_desc = optarg;
+                break;
+            case 'M':
+                source_mask_radius = atoi(optarg);
+                break;
+            case 'p':
+                psf_desc = optarg;
+                break;
             default:
                 goto argument_error;
         }
     }
     if (optind != argc - 1) {
         argument_error:
-            fprintf(stderr, "usage: %s [-o OUT] [--sky=SKY] [--catalog=CATALOG] [--detect=DETECT] [--mask=MASK] IN\n", argv[0]);
+            fprintf(stderr, "usage: %s [-o OUT] [--sky=SKY] [--catalog=CATALOG] [--detect=DETECT] [--mask=MASK] [--cosmicray=CR] [--mask-sources=RADIUS] [--psf=PSF] [--stream] IN\n", argv[0]);
             return 1;
     }
     input_file = argv[optind];
 
+    if (stream) {
+        // detection only, without holding the image in memory
+        if (! (detect_desc && catalog_file) || output_file || skyest_desc || mask_file || crop || cosmicray_desc || psf_desc)
+            goto argument_error;
+        auto log_indent = logger.info("detecting sources (streaming)...").indent();
+        std::ofstream os(catalog_file);
+        detect_stream(detect_desc, input_file, [&](const Source &s) {
+            os << s << std::endl;
+        });
+        return 0;
+    }
+
     logger.info("loading %s...", input_file);
 
     fitscc fits;
@@ -77,16 +109,44 @@ int main(int argc, char *argv[]) try {
         data = crop_nan(data);
     }
 
+    if (cosmicray_desc) {
+        auto log_indent = logger.info("rejecting cosmic rays...").indent();
+        mdarray_uchar mask(false, data.length(0), data.length(1));
+        find_cosmic_rays(cosmicray_desc, data, mask);
+        // the later stages skip NaN, as they do for --mask
+        for (int i = 0;  i < data.length();  i++) {
+            if (mask[i] & COSMICRAY)
+                data[i] = NAN;
+        }
+        fits.append_image("MASK", 0, FITS::BYTE_T);
+        fits.image("MASK").uchar_array() = mask;
+    }
+
+    SkyEstimator::PTR se;
     if (skyest_desc) {
         auto log_indent = logger.info("estimating sky...").indent();
-        auto se = SkyEstimator::initialize(skyest_desc, data);
-        auto sky = se->surface();
-        data -= sky;
+        se = SkyEstimator::initialize(skyest_desc, data);
+        se->subtract(data);
     }
 
     if (detect_desc && catalog_file) {
         auto log_indent = logger.info("detecting sources...").indent();
-        auto sources = detect(detect_desc, data);
+        BitPlane footprints;
+        auto sources = detect(detect_desc, data, nullptr, &footprints);
+        if (skyest_desc && source_mask_radius >= 0) {
+            // second pass: the sky without the source footprints grown by the radius
+            auto log_indent = logger.info("re-estimating sky without sources...").indent();
+            const BitPlane masked = footprints.dilate(source_mask_radius);
+            logger.info("%d pixels masked", masked.count());
+            se->add(data);
+            se = SkyEstimator::initialize(skyest_desc, data, masked);
+            se->subtract(data);
+            sources = detect(detect_desc, data);
+        }
+        if (psf_desc) {
+            auto log_indent = logger.info("fitting PSF...").indent();
+            sources = fit_psf(psf_desc, data, sources);
+        }
         std::ofstream os(catalog_file);
         for (const Source &s: sources) {
             os << s << std::endl;
@@ -8,7 +8,20 @@
 #include <limits>
 #include <boost/progress.hpp>
 #include <cmath>
+#include <omp.h>
+#include <deque>
+#include <future>
+#include <boost/lexical_cast.hpp>
+#include <boost/format.hpp>
+#include <stdexcept>
+#include <map>
+#include <set>
+#include <fstream>
+#include <stdio.h>
 #include "mdarray_interpolate.h"
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
 
 
 using namespace astralcat;
@@ -19,93 +32,545 @@ using std::string;
 
 namespace {
 
-    mdarray_float read_exposure(const char *filename) {
+    // one image per channel (e.g. CHANNEL_R, CHANNEL_G and CHANNEL_B of raw2fits)
+    typedef std::vector<mdarray_float> Planes;
+
+    // the colour planes are weighted together, so their number is bounded
+    const int max_channels = 8;
+
+
+    /*
+     * the image HDUs of the channels, scaled by EXPTIME: the first one if extnames is
+     * empty, otherwise those named extnames (an unnamed channel matches the unnamed HDU
+     * at its index), so that exposures whose HDUs are ordered differently still stack.
+     */
+    Planes read_exposure(const char *filename, const std::vector<string> &extnames) {
         fitscc fits;
         fits.read_stream(filename);
-        auto &hdu = fits.image(0L);
-        hdu.convert_type(FITS::FLOAT_T);
-        mdarray_float data = hdu.float_array();
-        data *= hdu.header("EXPTIME").dvalue();
-        return data;
+        Planes planes(std::max<size_t>(1, extnames.size()));
+        for (int c = 0;  c < planes.size();  c++) {
+            long index = c;
+            if (! extnames.empty() && ! extnames[c].empty()) {
+                index = fits.index(extnames[c].c_str());
+                if (index < 0)
+                    throw std::runtime_error((boost::format("%s: no channel %s") % filename % extnames[c]).str());
+            }
+            if (index >= fits.length() || fits.hdutype(index) != FITS::IMAGE_HDU ||
+                ! extnames.empty() && extnames[c].empty() && ! string(fits.image(index).extname()).empty())
+                throw std::runtime_error((boost::format("%s: no image HDU %d for channel %d") % filename % index % c).str());
+            auto &hdu = fits.image(index);
+            const double exptime = hdu.header("EXPTIME").dvalue();
+            if (! isfinite(exptime))
+                throw std::runtime_error((boost::format("%s: no EXPTIME") % filename).str());
+            hdu.convert_type(FITS::FLOAT_T);
+            planes[c] = hdu.float_array();
+            planes[c] *= exptime;
+        }
+        return planes;
     }
 
-    Warper inverse(Warper &warper, double min_x, double max_x, double min_y, double max_y) {
-        const int nx = 100,
-                  ny = 100;
-        auto fitter_x = PolynomialFitter2D::initialize(warper.order()),
-             fitter_y = PolynomialFitter2D::initialize(warper.order());
-        for (int iy = 0;  iy <= ny;  iy++) {
-            double r = (double)iy / ny,
-                   y = r*max_y + (1.-r)*min_y;
-            for (int ix = 0;  ix <= nx;  ix++) {
-                double r = (double)ix / nx,
-                       x = r*max_x + (1.-r)*min_x;
-                vec2 w = warper.apply({x, y});
-                fitter_x->add(w[0], w[1], x);
-                fitter_y->add(w[0], w[1], y);
+    // a rectangle [x0, x1) x [y0, y1) on the canvas
+    struct Box {
+        int x0, y0, x1, y1;
+        bool empty() const { return x0 >= x1 || y0 >= y1; }
+        Box intersect(const Box &o) const {
+            return {std::max(x0, o.x0), std::max(y0, o.y0), std::min(x1, o.x1), std::min(y1, o.y1)};
+        }
+    };
+
+
+    // a warped exposure covering only its footprint; data[c](0, 0) is canvas pixel (x0, y0)
+    struct Tile {
+        Planes data;
+        int x0, y0;
+    };
+
+
+    /*
+     * the inverse warper and its jacobian sampled every `step` canvas pixels and
+     * interpolated bilinearly in between, so that the resampling loop does not evaluate
+     * three Coeff2D polynomials per pixel.
+     * step is halved until, at every cell centre where bilinear interpolation is worst,
+     * the interpolated position is within `tolerance` pixels of the exact one and the
+     * jacobian, which sizes the resampling kernel, within `jacobian_tolerance` of it
+     * relative to its largest element.
+     * step = 0 (or a field that never meets the tolerance) evaluates the warper exactly.
+     */
+    class WarpField {
+        enum { U, V, U_X, V_X, U_Y, V_Y, N };
+
+        const Warper &i_warper;
+        vec2 offset;
+        Box box;
+        int step, nx, ny;
+        std::vector<double> grid;
+
+        void exact(double x, double y, double *g) const {
+            const vec2 xy = {x + offset[0], y + offset[1]},
+                       uv = i_warper.apply(xy),
+                       d1 = i_warper.deriv_1(xy),
+                       d2 = i_warper.deriv_2(xy);
+            g[U]   = uv[0];  g[V]   = uv[1];
+            g[U_X] = d1[0];  g[V_X] = d1[1];
+            g[U_Y] = d2[0];  g[V_Y] = d2[1];
+        }
+
+        void interpolate(double x, double y, double *g) const {
+            const double fx = (x - box.x0) / step,
+                         fy = (y - box.y0) / step;
+            const int i = std::min(std::max((int)fx, 0), nx - 2),
+                      j = std::min(std::max((int)fy, 0), ny - 2);
+            const double tx = fx - i,
+                         ty = fy - j;
+            const double *g00 = &grid[N * ( j      * nx + i    )],
+                         *g10 = &grid[N * ( j      * nx + i + 1)],
+                         *g01 = &grid[N * ((j + 1) * nx + i    )],
+                         *g11 = &grid[N * ((j + 1) * nx + i + 1)];
+            for (int k = 0;  k < N;  k++) {
+                g[k] = (1. - ty) * ((1. - tx) * g00[k] + tx * g10[k]) +
+                             ty  * ((1. - tx) * g01[k] + tx * g11[k]);
             }
         }
-        fitter_x->fit();
-        fitter_y->fit();
-        return Warper(fitter_x->getCoeff(), fitter_y->getCoeff());
-    }
 
+        void build() {
+            nx = (box.x1 - box.x0 - 1) / step + 2;
+            ny = (box.y1 - box.y0 - 1) / step + 2;
+            grid.resize(N * nx * ny);
+            for (int j = 0;  j < ny;  j++)  for (int i = 0;  i < nx;  i++)
+                exact(box.x0 + i * step, box.y0 + j * step, &grid[N * (j * nx + i)]);
+        }
 
-    const int lanczos_degree = 2;
+        // the largest position error in pixels and jacobian error relative to the jacobian
+        void max_error(double &err, double &jacobian_err) const {
+            double e[N], g[N];
+            err = jacobian_err = 0.;
+            for (int j = 0;  j < ny - 1;  j++)  for (int i = 0;  i < nx - 1;  i++) {
+                const double x = box.x0 + (i + 0.5) * step,
+                             y = box.y0 + (j + 0.5) * step;
+                exact(x, y, e);
+                interpolate(x, y, g);
+                err = std::max(err, std::max(std::abs(e[U] - g[U]), std::abs(e[V] - g[V])));
+                double scale = 0.,
+                       d = 0.;
+                for (int k = U_X;  k < N;  k++) {
+                    scale = std::max(scale, std::abs(e[k]));
+                    d = std::max(d, std::abs(e[k] - g[k]));
+                }
+                jacobian_err = std::max(jacobian_err, scale > 0. ? d / scale : d);
+            }
+        }
 
+    public:
+        WarpField(const Warper &i_warper, const vec2 &offset, const Box &box, int step, double tolerance, double jacobian_tolerance) :
+            i_warper(i_warper), offset(offset), box(box), step(step)
+        {
+            for (;  this->step > 1;  this->step /= 2) {
+                build();
+                double err, jacobian_err;
+                max_error(err, jacobian_err);
+                if (err <= tolerance && jacobian_err <= jacobian_tolerance) {
+                    logger.debug("warp field: step=%d error=%g jacobian error=%g", this->step, err, jacobian_err);
+                    return;
+                }
+            }
+            logger.debug("warp field: exact evaluation");
+            this->step = 0;
+            grid.clear();
+        }
+
+        // uv and jacobian (d1 = d(uv)/dx, d2 = d(uv)/dy) at canvas pixel (x, y)
+        void at(int x, int y, vec2 &uv, vec2 &d1, vec2 &d2) const {
+            double g[N];
+            if (step > 0)
+                interpolate(x, y, g);
+            else
+                exact(x, y, g);
+            uv = {g[U],   g[V]};
+            d1 = {g[U_X], g[V_X]};
+            d2 = {g[U_Y], g[V_Y]};
+        }
+    };
 
-    inline double sinc(double x) {
-        return sin(M_PI*x) / (M_PI * x);
-    }
 
+    /*
+     * source pixels around uv weighted by K(a1) K(a2), where a = J^-1 (du, dv) is the offset
+     * in canvas pixels and J = (d1 d2) the local jacobian of the inverse warp.
+     * the weights are computed once and applied to every plane of src, which holds rows
+     * [v0, v0 + src[c].length(1)) of the exposure; out[c] receives the result of plane c.
+     */
+    template <typename KERNEL>
+    inline void convolveOne(const Planes &src, int v0, const vec2 &uv, const vec2 &d1, const vec2 &d2, float *out) {
+        const int channels = src.size();
+        const double kernel_size = KERNEL::radius;
 
-    inline double lanczos_kernel(double r, int degree) {
-        r = std::abs(r);
-        if (r == 0.) {
-            return 1.;
+        const double _D = 1. / (d1[0]*d2[1] - d2[0]*d1[1]),
+                     max_x = kernel_size * std::max(1., std::abs(d1[0]) + std::abs(d2[0])),
+                     max_y = kernel_size * std::max(1., std::abs(d1[1]) + std::abs(d2[1]));
+
+        const int ui = (int)floor(uv[0]),
+                  vi = (int)floor(uv[1]);
+        const double fu = uv[0] - ui,
+                     fv = uv[1] - vi;
+
+        double sum[max_channels] = {},
+               k_sum = 0.;
+
+        for (int y = (int)ceil(fv - max_y);  y <= (int)floor(fv + max_y);  y++) {
+            for (int x = (int)ceil(fu - max_x);  x <= (int)floor(fu + max_x);  x++) {
+                const double du = x - fu,
+                             dv = y - fv,
+                             a1 = _D * (  d2[1]*du - d2[0]*dv),
+                             a2 = _D * (- d1[1]*du + d1[0]*dv),
+                             k = KERNEL::weight(a1) * KERNEL::weight(a2);
+                for (int c = 0;  c < channels;  c++)
+                    sum[c] += k * src[c](ui + x, vi + y - v0);
+                k_sum += k;
+            }
         }
-        else if (r > degree) {
-            return 0.;
+
+        for (int c = 0;  c < channels;  c++)
+            out[c] = sum[c] / k_sum;
+    }
+
+
+    // kernel weights tabulated at 1/resolution pixel steps
+    template <typename KERNEL>
+    class KernelTable {
+        static const int resolution = 4096;
+        std::vector<float> w;
+    public:
+        KernelTable() : w(KERNEL::radius * resolution + 2) {
+            for (int i = 0;  i < w.size();  i++)
+                w[i] = KERNEL::weight((double)i / resolution);
         }
-        else {
-            return sinc(r) * sinc(r / degree);
+        float operator()(double r) const {
+            const double i = std::abs(r) * resolution + 0.5;
+            return i < w.size() - 1 ? w[(int)i] : 0.f;
         }
+    };
+
+
+    // sum_i k[i] p[i]
+    inline float dot(const float *k, const float *p, int n) {
+        int i = 0;
+        float s = 0.f;
+#if defined(__AVX__)
+        __m256 acc8 = _mm256_setzero_ps();
+        for (;  i + 8 <= n;  i += 8)
+            acc8 = _mm256_add_ps(acc8, _mm256_mul_ps(_mm256_loadu_ps(k + i), _mm256_loadu_ps(p + i)));
+        float t8[8];
+        _mm256_storeu_ps(t8, acc8);
+        for (int j = 0;  j < 8;  j++)
+            s += t8[j];
+#endif
+#if defined(__SSE__)
+        __m128 acc4 = _mm_setzero_ps();
+        for (;  i + 4 <= n;  i += 4)
+            acc4 = _mm_add_ps(acc4, _mm_mul_ps(_mm_loadu_ps(k + i), _mm_loadu_ps(p + i)));
+        float t4[4];
+        _mm_storeu_ps(t4, acc4);
+        for (int j = 0;  j < 4;  j++)
+            s += t4[j];
+#endif
+        for (;  i < n;  i++)
+            s += k[i] * p[i];
+        return s;
     }
 
 
-    inline double convolveOne(const mdarray_float &src, const Warper &i_warper, const vec2 &xy) {
-        const double kernel_size = lanczos_degree;
+    /*
+     * convolveOne with tabulated weights and unchecked access inside the exposure.
+     * taps are factored into row and column weights when the off-diagonal jacobian terms
+     * shift them by less than separable_tolerance pixels.
+     */
+    template <typename KERNEL>
+    inline void convolveTable(const Planes &src, int v0, const vec2 &uv, const vec2 &d1, const vec2 &d2, double separable_tolerance, float *out) {
+        static const KernelTable<KERNEL> table;
+        const int channels = src.size();
+        const int max_taps = 64;
+        const double kernel_size = KERNEL::radius;
 
-        const vec2 uv = i_warper.apply(xy),
-                   d1 = i_warper.deriv_1(xy),
-                   d2 = i_warper.deriv_2(xy);
+        const double _D = 1. / (d1[0]*d2[1] - d2[0]*d1[1]),
+                     max_x = kernel_size * std::max(1., std::abs(d1[0]) + std::abs(d2[0])),
+                     max_y = kernel_size * std::max(1., std::abs(d1[1]) + std::abs(d2[1]));
 
-        const double _D = d1[0]*d2[1] - d2[0]*d1[1],
-                     max_x = kernel_size * (std::abs(d1[0]) + std::abs(d2[0])),
-                     max_y = kernel_size * (std::abs(d1[1]) + std::abs(d2[1]));
+        const int ui = (int)floor(uv[0]),
+                  vi = (int)floor(uv[1]) - v0;
+        const double fu = uv[0] - floor(uv[0]),
+                     fv = uv[1] - floor(uv[1]);
 
-        double sum = 0.,
-               k_sum = 0.;
+        const int x_lo = (int)ceil(fu - max_x), x_hi = (int)floor(fu + max_x),
+                  y_lo = (int)ceil(fv - max_y), y_hi = (int)floor(fv + max_y),
+                  nx = x_hi - x_lo + 1,
+                  ny = y_hi - y_lo + 1;
+
+        const bool inside = ui + x_lo >= 0 && ui + x_hi < src[0].length(0) &&
+                            vi + y_lo >= 0 && vi + y_hi < src[0].length(1);
 
-        for (int y = (int)(-max_y + 1.);  y <= (int)max_y;  y++) {
-            for (int x = (int)(-max_x + 1.);  x <= (int)max_x;  x++) {
-                const double a1 = _D * (  d2[1]*x - d2[0]*y),
-                             a2 = _D * (- d1[1]*x + d1[0]*y),
-                             k = lanczos_kernel(sqrt(a1*a1 + a2*a2), lanczos_degree);
-                sum += k * src((int)uv[0] + x, (int)uv[1] + y);
+        const bool diagonal = (std::abs(d1[1]) + std::abs(d2[0])) * kernel_size <= separable_tolerance;
+
+        if (inside && diagonal && nx <= max_taps && ny <= max_taps) {
+            float kx[max_taps], ky[max_taps];
+            double kx_sum = 0., ky_sum = 0.;
+            for (int i = 0;  i < nx;  i++)
+                kx_sum += kx[i] = table(_D * d2[1] * (x_lo + i - fu));
+            for (int j = 0;  j < ny;  j++)
+                ky_sum += ky[j] = table(_D * d1[0] * (y_lo + j - fv));
+            for (int c = 0;  c < channels;  c++) {
+                double sum = 0.;
+                for (int j = 0;  j < ny;  j++)
+                    sum += ky[j] * dot(kx, src[c].array_ptr(ui + x_lo, vi + y_lo + j), nx);
+                out[c] = sum / (kx_sum * ky_sum);
+            }
+            return;
+        }
+
+        double sum[max_channels] = {},
+               k_sum = 0.;
+        for (int y = y_lo;  y <= y_hi;  y++) {
+            for (int x = x_lo;  x <= x_hi;  x++) {
+                const double du = x - fu,
+                             dv = y - fv,
+                             a1 = _D * (  d2[1]*du - d2[0]*dv),
+                             a2 = _D * (- d1[1]*du + d1[0]*dv),
+                             k = table(a1) * table(a2);
+                for (int c = 0;  c < channels;  c++)
+                    sum[c] += k * (inside ? src[c].array_ptr(0, vi + y)[ui + x] : src[c](ui + x, vi + y));
                 k_sum += k;
             }
         }
+        for (int c = 0;  c < channels;  c++)
+            out[c] = sum[c] / k_sum;
+    }
+
+
+    enum kernel_t {
+        NEAREST,
+        BILINEAR,
+        BICUBIC,
+        LANCZOS2,
+        LANCZOS3,
+        LANCZOS4,
+        LANCZOS5
+    };
 
-        return sum / k_sum;
-        /*
-        using namespace astralcat::mdarray_wrapper;
-        const vec2 uv = i_warper.apply(xy);
-        const auto &_src = bilinear(src);
-        return _src.interpolate(uv[0], uv[1]);
-        */
+
+    kernel_t parse_kernel(const string &name) {
+        const std::map<string, kernel_t> table = {
+            {"nearest",  NEAREST},
+            {"bilinear", BILINEAR},
+            {"bicubic",  BICUBIC},
+            {"lanczos2", LANCZOS2},
+            {"lanczos3", LANCZOS3},
+            {"lanczos4", LANCZOS4},
+            {"lanczos5", LANCZOS5}
+        };
+        auto it = table.find(name);
+        if (it == table.end())
+            throw std::invalid_argument((boost::format("invalid kernel: %s") % name).str());
+        return it->second;
+    }
+
+
+    int kernel_radius(kernel_t k) {
+        switch (k) {
+            case NEAREST:   return kernel::Nearest::radius;
+            case BILINEAR:  return kernel::Bilinear::radius;
+            case BICUBIC:   return kernel::Bicubic::radius;
+            case LANCZOS2:  return kernel::Lanczos<2>::radius;
+            case LANCZOS3:  return kernel::Lanczos<3>::radius;
+            case LANCZOS4:  return kernel::Lanczos<4>::radius;
+            case LANCZOS5:  return kernel::Lanczos<5>::radius;
+        }
+        return 0;
     }
 
+
+    enum combine_t {
+        SUM,
+        MEAN,
+        CLIPPED_MEAN
+    };
+
+
+    /*
+     * running sum, weight and coverage planes of warped exposures, one set per channel.
+     * a clipped mean needs a second pass over the exposures: start_clipping() freezes
+     * the mean and scatter of the first pass and later folds reject pixels outside them.
+     * SUM and SUM2 are double: with EXPTIME scaled pixels of 1e5-1e6, sum2 / w - mean^2
+     * in float would be all rounding.
+     */
+    class Accumulator {
+        Box box;
+        std::vector<mdarray_double> sum, sum2;
+        std::vector<mdarray_float> weight, count;
+        // the clipping limits and the box they cover, which partials share
+        std::shared_ptr<const Planes> lower, upper;
+        Box limits_box;
+
+    public:
+        Accumulator(const Box &box, int channels = 1) :
+            box(box),
+            sum   (channels, mdarray_double(false, box.x1 - box.x0, box.y1 - box.y0)),
+            sum2  (channels, mdarray_double(false, box.x1 - box.x0, box.y1 - box.y0)),
+            weight(channels, mdarray_float(false, box.x1 - box.x0, box.y1 - box.y0)),
+            count (channels, mdarray_float(false, box.x1 - box.x0, box.y1 - box.y0)),
+            limits_box(box)
+        {
+            reset();
+        }
+
+        // an empty accumulator over part of the box, sharing the clipping limits
+        Accumulator partial(const Box &part) const {
+            Accumulator p(box.intersect(part), channels());
+            p.lower = lower;
+            p.upper = upper;
+            p.limits_box = limits_box;
+            return p;
+        }
+
+        int channels() const {
+            return sum.size();
+        }
+
+        const Box &region() const {
+            return box;
+        }
+
+        // shifts the box; the planes stay as they are
+        void move_to(int x0, int y0) {
+            box = {x0, y0, x0 + box.x1 - box.x0, y0 + box.y1 - box.y0};
+        }
+
+        // adds the overlapping part of other, which may cover a different box
+        void merge(const Accumulator &other) {
+            if (other.channels() != channels())
+                throw std::runtime_error((boost::format("number of channels differs: %d != %d") % other.channels() % channels()).str());
+            const Box overlap = box.intersect(other.box);
+            const int width = box.x1 - box.x0,
+                      other_width = other.box.x1 - other.box.x0;
+            for (int c = 0;  c < channels();  c++) {
+                for (int y = overlap.y0;  y < overlap.y1;  y++) {
+                    for (int x = overlap.x0;  x < overlap.x1;  x++) {
+                        const int i = (x - box.x0) + (y - box.y0) * width,
+                                  j = (x - other.box.x0) + (y - other.box.y0) * other_width;
+                        sum[c][i] += other.sum[c][j];
+                        sum2[c][i] += other.sum2[c][j];
+                        weight[c][i] += other.weight[c][j];
+                        count[c][i] += other.count[c][j];
+                    }
+                }
+            }
+        }
+
+        // HDU name of a plane; channel 0 keeps the bare name
+        static string plane_name(const char *name, int c) {
+            return c == 0 ? string(name) : (boost::format("%s_%d") % name % c).str();
+        }
+
+        // the planes as SUM, SUM2, WEIGHT and COUNT image HDUs (SUM_1, ... for further channels)
+        void write(fitscc &fits) const {
+            for (int c = 0;  c < channels();  c++) {
+                fits.append_image(plane_name("SUM", c).c_str(), 0, FITS::DOUBLE_T);
+                fits.image(fits.length() - 1).double_array() = sum[c];
+                fits.append_image(plane_name("SUM2", c).c_str(), 0, FITS::DOUBLE_T);
+                fits.image(fits.length() - 1).double_array() = sum2[c];
+                fits.append_image(plane_name("WEIGHT", c).c_str(), 0, FITS::FLOAT_T);
+                fits.image(fits.length() - 1).float_array() = weight[c];
+                fits.append_image(plane_name("COUNT", c).c_str(), 0, FITS::FLOAT_T);
+                fits.image(fits.length() - 1).float_array() = count[c];
+            }
+        }
+
+        // states saved before SUM and SUM2 were double are converted
+        static Accumulator read(fitscc &fits) {
+            mdarray_float &w = fits.image("WEIGHT").float_array();
+            int channels = 1;
+            while (fits.index(plane_name("SUM", channels).c_str()) >= 0)
+                channels++;
+            Accumulator acc({0, 0, (int)w.length(0), (int)w.length(1)}, channels);
+            for (int c = 0;  c < channels;  c++) {
+                acc.sum[c] = fits.image(plane_name("SUM", c).c_str()).convert_type(FITS::DOUBLE_T).double_array();
+                acc.sum2[c] = fits.image(plane_name("SUM2", c).c_str()).convert_type(FITS::DOUBLE_T).double_array();
+                acc.weight[c] = fits.image(plane_name("WEIGHT", c).c_str()).float_array();
+                acc.count[c] = fits.image(plane_name("COUNT", c).c_str()).float_array();
+            }
+            return acc;
+        }
+
+        void reset() {
+            for (int c = 0;  c < channels();  c++) {
+                sum[c] = 0.;
+                sum2[c] = 0.;
+                weight[c] = 0.;
+                count[c] = 0.;
+            }
+        }
+
+        void fold(const Tile &tile, double w = 1.) {
+            assert(tile.data.size() == channels());
+            const int width = box.x1 - box.x0,
+                      limits_width = limits_box.x1 - limits_box.x0,
+                      tile_width = tile.data[0].length(0);
+            const Box overlap = box.intersect({tile.x0, tile.y0, tile.x0 + tile_width, tile.y0 + (int)tile.data[0].length(1)});
+            if (overlap.empty())
+                return;
+            #pragma omp parallel for if(! omp_in_parallel())
+            for (int y = overlap.y0;  y < overlap.y1;  y++) {
+                for (int c = 0;  c < channels();  c++) {
+                    for (int x = overlap.x0;  x < overlap.x1;  x++) {
+                        const int i = (x - box.x0) + (y - box.y0) * width;
+                        const double z = tile.data[c][(x - tile.x0) + (y - tile.y0) * tile_width];
+                        if (! isfinite(z))
+                            continue;
+                        const int l = (x - limits_box.x0) + (y - limits_box.y0) * limits_width;
+                        if (lower && ! ((*lower)[c][l] <= z && z <= (*upper)[c][l]))
+                            continue;
+                        sum[c][i] += w * z;
+                        sum2[c][i] += w * z * z;
+                        weight[c][i] += w;
+                        count[c][i] += 1.;
+                    }
+                }
+            }
+        }
+
+        void start_clipping(double clipping_sigma) {
+            auto l = std::make_shared<Planes>(channels()),
+                 u = std::make_shared<Planes>(channels());
+            for (int c = 0;  c < channels();  c++) {
+                (*l)[c] = mdarray_float(false, sum[c].length(0), sum[c].length(1));
+                (*u)[c] = mdarray_float(false, sum[c].length(0), sum[c].length(1));
+                for (int i = 0;  i < sum[c].length();  i++) {
+                    const double mean = sum[c][i] / weight[c][i],
+                                 stddev = sqrt(std::max(0., sum2[c][i] / weight[c][i] - mean * mean));
+                    (*l)[c][i] = mean - clipping_sigma * stddev;
+                    (*u)[c][i] = mean + clipping_sigma * stddev;
+                }
+            }
+            lower = l;
+            upper = u;
+            limits_box = box;
+            reset();
+        }
+
+        mdarray_float result(combine_t combine, int c = 0) const {
+            mdarray_float r(false, sum[c].length(0), sum[c].length(1));
+            for (int i = 0;  i < r.length();  i++) {
+                if (count[c][i] == 0.)
+                    r[i] = NAN;
+                else
+                    r[i] = combine == SUM ? sum[c][i] : sum[c][i] / weight[c][i];
+            }
+            return r;
+        }
+
+        // the coverage of channel 0; every channel of an exposure covers the same pixels
+        const mdarray_float &coverage() const {
+            return count[0];
+        }
+    };
+
 }
 
 
@@ -124,11 +589,92 @@ namespace {
  */
 
 struct astralcat::Stacker::Impl {
+    // the part of an exposure a canvas box needs; src holds exposure rows [v0, ...)
+    struct Chunk {
+        Box box;
+        Planes src;
+        int v0;
+    };
+
+
     std::vector<string> files;
     std::vector<Warper> forward_warpers,
                         inverse_warpers;
+    std::vector<int> src_width, src_height;
+    std::vector<Box> footprints;
     int width, height;
     double cx, cy;
+    int band_height;
+    combine_t combine;
+    double clipping_sigma;
+    int warp_grid;
+    double warp_tolerance, warp_jacobian_tolerance;
+    kernel_t kernel_type;
+    bool use_table;
+    double separable_tolerance;
+    int prefetch;
+    enum { AUTO, ROWS, EXPOSURES } schedule;
+    bool all_channels;
+    // EXTNAMEs of the stacked channels; the warp and the kernel weights are shared by all of them
+    std::vector<string> channel_names;
+    std::vector< std::shared_ptr<FitsRowReader> > readers;
+    // with band_height and combine=clipped_mean, the chunks of the current band, read once for both passes
+    std::vector< std::shared_ptr<Chunk> > band_chunks;
+    // accumulated planes of earlier runs and their canvas origin, and the planes of this run
+    std::shared_ptr<Accumulator> state, result;
+    double state_cx, state_cy;
+
+
+    Impl(StrKeyValue args) {
+        reverse_merge(args, {{"band_height",    "0"},
+                             {"combine",        "sum"},
+                             {"clipping_sigma", "3.0"},
+                             {"warp_grid",      "16"},
+                             {"warp_tolerance", "0.01"},
+                             {"warp_jacobian_tolerance", "0.001"},
+                             {"resampler",      "exact"},
+                             {"kernel",         "lanczos2"},
+                             {"separable_tolerance", "0.01"},
+                             {"prefetch",       "1"},
+                             {"schedule",       "auto"},
+                             {"channels",       "first"}});
+        logger.info("Stacker: %s", boost::lexical_cast<string>(args));
+        band_height = atoi(args["band_height"].c_str());
+        clipping_sigma = atof(args["clipping_sigma"].c_str());
+        warp_grid = atoi(args["warp_grid"].c_str());
+        warp_tolerance = atof(args["warp_tolerance"].c_str());
+        warp_jacobian_tolerance = atof(args["warp_jacobian_tolerance"].c_str());
+        separable_tolerance = atof(args["separable_tolerance"].c_str());
+        prefetch = atoi(args["prefetch"].c_str());
+        if (args["schedule"] == "auto")
+            schedule = AUTO;
+        else if (args["schedule"] == "rows")
+            schedule = ROWS;
+        else if (args["schedule"] == "exposures")
+            schedule = EXPOSURES;
+        else
+            throw std::invalid_argument((boost::format("invalid schedule: %s") % args["schedule"]).str());
+        if (args["channels"] == "first")
+            all_channels = false;
+        else if (args["channels"] == "all")
+            all_channels = true;
+        else
+            throw std::invalid_argument((boost::format("invalid channels: %s") % args["channels"]).str());
+        if (all_channels && band_height > 0)
+            throw std::invalid_argument("channels=all is not supported with band_height");
+        kernel_type = parse_kernel(args["kernel"]);
+        use_table = args["resampler"] == "table";
+        if (args["resampler"] != "table" && args["resampler"] != "exact")
+            throw std::invalid_argument((boost::format("invalid resampler: %s") % args["resampler"]).str());
+        if (args["combine"] == "sum")
+            combine = SUM;
+        else if (args["combine"] == "mean")
+            combine = MEAN;
+        else if (args["combine"] == "clipped_mean")
+            combine = CLIPPED_MEAN;
+        else
+            throw std::invalid_argument((boost::format("invalid combine method: %s") % args["combine"]).str());
+    }
 
 
     void add(const Warper &f_warper, const char *filename) {
@@ -137,42 +683,380 @@ struct astralcat::Stacker::Impl {
     }
 
 
+    /*
+     * resumes from the planes saved by save_state().
+     * exposures added afterwards are folded into them; the canvas keeps its pixel grid and
+     * grows when a new exposure falls outside it.
+     */
+    void load_state(const char *state_file) {
+        auto log_indent = logger.info("loading stack state: %s...", state_file).indent();
+        if (band_height > 0 || combine == CLIPPED_MEAN)
+            throw std::invalid_argument("stack state is not supported with band_height or combine=clipped_mean");
+        fitscc fits;
+        fits.read_stream(state_file);
+        state = std::make_shared<Accumulator>(Accumulator::read(fits));
+        state_cx = fits.image("SUM").header("CANVASX").dvalue();
+        state_cy = fits.image("SUM").header("CANVASY").dvalue();
+        logger.info("width=%d height=%d cx=%f cy=%f", state->region().x1, state->region().y1, state_cx, state_cy);
+    }
+
+
+    void save_state(const char *state_file) {
+        auto log_indent = logger.info("saving stack state: %s...", state_file).indent();
+        if (! result)
+            throw std::logic_error("stack state is only available after stacking without band_height");
+        fitscc fits;
+        result->write(fits);
+        fits.image("SUM").header("CANVASX").assign(cx);
+        fits.image("SUM").header("CANVASY").assign(cy);
+        fits.write_stream(state_file);
+    }
+
+
     void stack(const char *output_file) {
         auto log_indent = logger.info("stacking: out=%s...", output_file).indent();
+        if (state && (band_height > 0 || combine == CLIPPED_MEAN))
+            throw std::invalid_argument("stack state is not supported with band_height or combine=clipped_mean");
+        set_channels();
         set_bbox_and_warpers();
-        
-        mdarray_float pool(false, width, height, files.size());
 
-        for (int z = 0;  z < files.size();  z++) {
-            auto log_indent = logger.info("warping: file=%s...", files[z]).indent();
-            mdarray_float src = read_exposure(files[z].c_str());
-            pool.paste(warp(inverse_warpers[z], src), 0, 0, z);
+        if (band_height > 0)
+            stack_bands(output_file);
+        else
+            stack_canvas(output_file);
+    }
+
+
+    /*
+     * with channels=all every image HDU of the first exposure is a channel, e.g. the
+     * CHANNEL_R, CHANNEL_G and CHANNEL_B of raw2fits; otherwise only the first one.
+     * Only its headers are read; the other exposures are matched to it by EXTNAME.
+     */
+    void set_channels() {
+        channel_names.clear();
+        if (! all_channels) {
+            channel_names.push_back("COADD");
+            return;
+        }
+        channel_names = fits_image_extnames(files.at(0).c_str());
+        std::set<string> named;
+        for (const auto &name: channel_names) {
+            if (! name.empty() && ! named.insert(name).second)
+                throw std::runtime_error((boost::format("%s: more than one channel named %s") % files[0] % name).str());
         }
+        if (channel_names.size() > max_channels)
+            throw std::runtime_error((boost::format("%s: more than %d channels") % files[0] % max_channels).str());
+        logger.info("channels: %d", channel_names.size());
+    }
 
-        logger.info("stacking...");
-        pool = md_total_small_z(pool);
+
+    void stack_canvas(const char *output_file) {
+        const Box canvas = {0, 0, width, height};
+        const int channels = channel_names.size();
+        result = std::make_shared<Accumulator>(canvas, channels);
+        Accumulator &acc = *result;
+        if (state)
+            acc.merge(*state);
+        fold_exposures(acc, canvas);
 
         fitscc fits;
-        fits.append_image("COADD", 0, FITS::FLOAT_T);
-        fits.image(0L).float_array().swap(pool);
+        for (int c = 0;  c < channels;  c++) {
+            fits.append_image(channel_names[c].c_str(), 0, FITS::FLOAT_T);
+            fits.image(c).float_array() = acc.result(combine, c);
+        }
+        fits.append_image("COVERAGE", 0, FITS::FLOAT_T);
+        fits.image(channels).float_array() = acc.coverage();
         fits.write_stream(output_file);
     }
 
 
-    mdarray_float warp(const Warper &i_warper, const mdarray_float &src) {
-        mdarray_float dst(false, width, height);
+    /*
+     * streams the canvas in bands of band_height rows.
+     * for each band only the exposure rows that the inverse warper maps into it are read,
+     * and the finished band goes straight to the output file.  Each exposure is read
+     * once, top to bottom: the readers keep the rows the next band shares with this one.
+     * The COVERAGE HDU is streamed to a temporary file and appended at the end.
+     */
+    void stack_bands(const char *output_file) {
+        auto log_indent = logger.info("stacking in bands: band_height=%d...", band_height).indent();
+
+        for (const auto &f: files)
+            readers.push_back(std::make_shared<FitsRowReader>(f.c_str()));
+
+        const string coverage_file = string(output_file) + ".COVERAGE.tmp";
+        FitsRowWriter out(output_file, width, height, "COADD"),
+                      coverage(coverage_file.c_str(), width, height, "COVERAGE", true);
+
         boost::progress_display progress(height, std::cerr);
-        #pragma omp parallel
-        #pragma omp for
-        for (int y = 0;  y < dst.length(1);  y++) {
-            #pragma omp critical
-            ++progress;
-            for (int x = 0;  x < dst.length(0);  x++) {
-                dst(x, y) = convolveOne(src, i_warper, {x + cx, y + cy});
+        for (int y0 = 0;  y0 < height;  y0 += band_height) {
+            const int rows = std::min(band_height, height - y0);
+            const Box band = {0, y0, width, y0 + rows};
+            if (combine == CLIPPED_MEAN)
+                band_chunks.assign(files.size(), nullptr);
+            Accumulator acc(band);
+            fold_exposures(acc, band);
+            out.write(acc.result(combine));
+            coverage.write(acc.coverage());
+            band_chunks.clear();
+            progress += rows;
+        }
+        out.close();
+        coverage.close();
+        readers.clear();
+
+        {
+            std::ifstream in(coverage_file.c_str(), std::ios::binary);
+            std::ofstream app(output_file, std::ios::binary | std::ios::app);
+            app << in.rdbuf();
+            if (! app)
+                throw std::runtime_error((boost::format("failed to append COVERAGE to %s") % output_file).str());
+        }
+        remove(coverage_file.c_str());
+    }
+
+
+    // folds every exposure into acc, which covers the canvas region
+    void fold_exposures(Accumulator &acc, const Box &region) {
+        const int passes = combine == CLIPPED_MEAN ? 2 : 1;
+        for (int pass = 0;  pass < passes;  pass++) {
+            if (pass > 0)
+                acc.start_clipping(clipping_sigma);
+            const int outer = exposure_threads(region);
+            if (outer > 1)
+                fold_concurrently(acc, region, outer);
+            else
+                fold_sequentially(acc, region, pass, passes);
+        }
+    }
+
+
+    /*
+     * how many exposures to warp at once.
+     * rows mode gives every thread to one exposure at a time; that starves threads when a
+     * footprint has few rows, so auto moves threads over to exposures until each one
+     * still has at least min_rows_per_thread rows of its own exposure.
+     */
+    int exposure_threads(const Box &region) const {
+        const int min_rows_per_thread = 64,
+                  threads = omp_get_max_threads();
+        int n = 0;
+        long rows = 0;
+        for (const auto &f: footprints) {
+            const Box box = f.intersect(region);
+            if (! box.empty()) {
+                n++;
+                rows += box.y1 - box.y0;
+            }
+        }
+        if (schedule == ROWS || n <= 1)
+            return 1;
+        if (schedule == EXPOSURES)
+            return std::min(threads, n);
+        const long mean_rows = std::max(1L, rows / n);
+        return std::max(1, (int)std::min<long>(std::min(threads, n), (long)threads * min_rows_per_thread / mean_rows));
+    }
+
+
+    /*
+     * warps `outer` exposures at a time, each into a partial accumulator over its own
+     * footprint that is merged into acc when done; the remaining threads split each
+     * exposure's rows.  So memory grows with outer only by footprints, not by canvases.
+     */
+    void fold_concurrently(Accumulator &acc, const Box &region, int outer) {
+        const int inner = std::max(1, omp_get_max_threads() / outer);
+        logger.info("warping %d exposures at a time, %d threads each...", outer, inner);
+        omp_set_max_active_levels(2);
+
+        std::shared_ptr<boost::progress_display> progress;
+        if (band_height == 0)
+            progress = std::make_shared<boost::progress_display>(files.size(), std::cerr);
+
+        #pragma omp parallel for schedule(dynamic) num_threads(outer)
+        for (int z = 0;  z < files.size();  z++) {
+            Chunk chunk = load(z, region);
+            if (! chunk.box.empty()) {
+                Accumulator partial = acc.partial(chunk.box);
+                partial.fold(warp(inverse_warpers[z], chunk.src, chunk.v0, chunk.box, nullptr, inner));
+                #pragma omp critical
+                acc.merge(partial);
+            }
+            if (progress) {
+                #pragma omp critical
+                ++*progress;
+            }
+        }
+    }
+
+
+    /*
+     * one exposure at a time, all threads on its rows.
+     * up to `prefetch` exposures ahead of the one being warped are read on background
+     * threads, so at most prefetch + 1 decoded exposures are alive at a time.
+     */
+    void fold_sequentially(Accumulator &acc, const Box &region, int pass, int passes) {
+        std::deque< std::future<Chunk> > queue;
+        int next = 0;
+        for (int z = 0;  z < files.size();  z++) {
+            for (;  next < files.size() && next <= z + prefetch;  next++) {
+                queue.push_back(std::async(prefetch > 0 ? std::launch::async : std::launch::deferred,
+                                           &Impl::load, this, next, region));
             }
+            Chunk chunk = queue.front().get();
+            queue.pop_front();
+            if (chunk.box.empty())
+                continue;
+            if (band_height > 0) {
+                acc.fold(warp(inverse_warpers[z], chunk.src, chunk.v0, chunk.box));
+            }
+            else {
+                auto log_indent = logger.info("warping (pass %d/%d): file=%s...", pass + 1, passes, files[z]).indent();
+                boost::progress_display progress(warp_blocks(chunk.box), std::cerr);
+                const double t0 = omp_get_wtime();
+                Tile tile = warp(inverse_warpers[z], chunk.src, chunk.v0, chunk.box, &progress);
+                const double t = omp_get_wtime() - t0;
+                logger.info("%.2f s (%.2f Mpix/s)", t, tile.data[0].length() / t * 1.e-6);
+                acc.fold(tile);
+            }
+        }
+    }
+
+
+    // reads the part of exposure z that the canvas region needs; an empty box if none
+    Chunk load(int z, const Box &region) {
+        if (! band_chunks.empty() && band_chunks[z])
+            return *band_chunks[z];
+        Chunk chunk = {footprints[z].intersect(region), Planes(), 0};
+        if (chunk.box.empty())
+            return chunk;
+        if (readers.empty()) {
+            chunk.src = read_exposure(files[z].c_str(), all_channels ? channel_names : std::vector<string>());
+            return chunk;
         }
-        //ds9::show(dst, true);
-        return dst;
+        int v1;
+        if (! source_rows(z, chunk.box, chunk.v0, v1)) {
+            chunk.box = {0, 0, 0, 0};
+            return chunk;
+        }
+        const double exptime = readers[z]->header("EXPTIME");
+        if (! isfinite(exptime))
+            throw std::runtime_error((boost::format("%s: no EXPTIME") % files[z]).str());
+        chunk.src.push_back(readers[z]->read(chunk.v0, v1 - chunk.v0));
+        chunk.src[0] *= exptime;
+
+        // the rows the next band will need again
+        const Box next = footprints[z].intersect({0, region.y1, width, region.y1 + band_height});
+        int next_v0, next_v1;
+        readers[z]->keep_from(! next.empty() && source_rows(z, next, next_v0, next_v1) ? next_v0 : src_height[z]);
+
+        if (! band_chunks.empty())
+            band_chunks[z] = std::make_shared<Chunk>(chunk);
+        return chunk;
+    }
+
+
+    // rows [v0, v1) of exposure z needed to warp canvas box
+    bool source_rows(int z, const Box &box, int &v0, int &v1) const {
+        const Warper &i_warper = inverse_warpers[z];
+        const int step = 16;
+        double min_v = std::numeric_limits<double>::max(),
+               max_v = - std::numeric_limits<double>::max(),
+               margin = 0.;
+        auto sample = [&](double x, double y) {
+            const vec2 xy = {x + cx, y + cy},
+                       uv = i_warper.apply(xy),
+                       d1 = i_warper.deriv_1(xy),
+                       d2 = i_warper.deriv_2(xy);
+            min_v = std::min(min_v, uv[1]);
+            max_v = std::max(max_v, uv[1]);
+            margin = std::max(margin, kernel_radius(kernel_type) * std::max(1., std::abs(d1[1]) + std::abs(d2[1])));
+        };
+        // the warp is smooth over the box, so its edges bound the rows it touches
+        for (int x = box.x0;  x < box.x1 + step;  x += step) {
+            sample(std::min(x, box.x1 - 1), box.y0);
+            sample(std::min(x, box.x1 - 1), box.y1 - 1);
+        }
+        for (int y = box.y0;  y < box.y1 + step;  y += step) {
+            sample(box.x0,     std::min(y, box.y1 - 1));
+            sample(box.x1 - 1, std::min(y, box.y1 - 1));
+        }
+        v0 = std::max(0,                   (int)floor(min_v - margin) - 1);
+        v1 = std::min(src_height[z],        (int)ceil (max_v + margin) + 2);
+        return v0 < v1;
+    }
+
+
+    // warp() reports progress once per block of rows rather than per row
+    static const int warp_block_rows = 16;
+
+    static int warp_blocks(const Box &box) {
+        return (box.y1 - box.y0 + warp_block_rows - 1) / warp_block_rows;
+    }
+
+
+    // warps the canvas box from src, which holds exposure rows [v0, ...)
+    Tile warp(const Warper &i_warper, const Planes &src, int v0, const Box &box,
+              boost::progress_display *progress = nullptr, int threads = omp_get_max_threads()) {
+        switch (kernel_type) {
+            case NEAREST:   return warp_with<kernel::Nearest>   (i_warper, src, v0, box, progress, threads);
+            case BILINEAR:  return warp_with<kernel::Bilinear>  (i_warper, src, v0, box, progress, threads);
+            case BICUBIC:   return warp_with<kernel::Bicubic>   (i_warper, src, v0, box, progress, threads);
+            case LANCZOS2:  return warp_with<kernel::Lanczos<2>>(i_warper, src, v0, box, progress, threads);
+            case LANCZOS3:  return warp_with<kernel::Lanczos<3>>(i_warper, src, v0, box, progress, threads);
+            case LANCZOS4:  return warp_with<kernel::Lanczos<4>>(i_warper, src, v0, box, progress, threads);
+            case LANCZOS5:  return warp_with<kernel::Lanczos<5>>(i_warper, src, v0, box, progress, threads);
+        }
+        throw std::logic_error("unknown kernel");
+    }
+
+
+    template <typename KERNEL>
+    Tile warp_with(const Warper &i_warper, const Planes &src, int v0, const Box &box,
+                   boost::progress_display *progress, int threads) {
+        const int channels = src.size(),
+                  columns = box.x1 - box.x0,
+                  rows = box.y1 - box.y0;
+        Tile tile = {Planes(channels, mdarray_float(false, columns, rows)), box.x0, box.y0};
+        Planes &dst = tile.data;
+        const WarpField field(i_warper, {cx, cy}, box, warp_grid, warp_tolerance, warp_jacobian_tolerance);
+        #pragma omp parallel for schedule(dynamic) num_threads(threads)
+        for (int b = 0;  b < warp_blocks(box);  b++) {
+            for (int y = b * warp_block_rows;  y < std::min(rows, (b + 1) * warp_block_rows);  y++) {
+                for (int x = 0;  x < columns;  x++) {
+                    vec2 uv, d1, d2;
+                    float out[max_channels];
+                    field.at(x + box.x0, y + box.y0, uv, d1, d2);
+                    if (use_table)
+                        convolveTable<KERNEL>(src, v0, uv, d1, d2, separable_tolerance, out);
+                    else
+                        convolveOne<KERNEL>(src, v0, uv, d1, d2, out);
+                    for (int c = 0;  c < channels;  c++)
+                        dst[c](x, y) = out[c];
+                }
+            }
+            if (progress) {
+                #pragma omp critical
+                ++*progress;
+            }
+        }
+        //ds9::show(dst[0], true);
+        return tile;
+    }
+
+
+    // bounding box of the warped corners, still in warped (not canvas) coordinates
+    template <typename CORNERS>
+    static Box bounding_box(const CORNERS &corners) {
+        double min_x = std::numeric_limits<double>::max(),
+               max_x = - std::numeric_limits<double>::max(),
+               min_y = std::numeric_limits<double>::max(),
+               max_y = - std::numeric_limits<double>::max();
+        for (const auto &c: corners) {
+            min_x = std::min(min_x, c[0]);
+            max_x = std::max(max_x, c[0]);
+            min_y = std::min(min_y, c[1]);
+            max_y = std::max(max_y, c[1]);
+        }
+        return {(int)floor(min_x), (int)floor(min_y), (int)ceil(max_x) + 1, (int)ceil(max_y) + 1};
     }
 
 
@@ -181,9 +1065,9 @@ struct astralcat::Stacker::Impl {
         auto log_indent = logger.info("determining boundary...").indent();
 
         double min_x = std::numeric_limits<double>::max(),
-               max_x = std::numeric_limits<double>::min(),
+               max_x = - std::numeric_limits<double>::max(),
                min_y = std::numeric_limits<double>::max(),
-               max_y = std::numeric_limits<double>::min();
+               max_y = - std::numeric_limits<double>::max();
 
         for (int i = 0;  i < files.size();  i++) {
             logger.info("inverting warper: %s...", files[i]);
@@ -214,15 +1098,36 @@ struct astralcat::Stacker::Impl {
             }
 
             inverse_warpers.push_back(i_warper);
-            width  = naxis1;
-            height = naxis2;
+            src_width.push_back(naxis1);
+            src_height.push_back(naxis2);
+            footprints.push_back(bounding_box(corners));
         }
 
-        width  = (int)(max_x - min_x);
-        height = (int)(max_y - min_y);
+        if (state) {
+            // grow the saved canvas on its own pixel grid
+            min_x = std::min(min_x, state_cx);
+            min_y = std::min(min_y, state_cy);
+            max_x = std::max(max_x, state_cx + state->region().x1);
+            max_y = std::max(max_y, state_cy + state->region().y1);
+            cx = state_cx - ceil(state_cx - min_x);
+            cy = state_cy - ceil(state_cy - min_y);
+            width  = (int)ceil(max_x - cx);
+            height = (int)ceil(max_y - cy);
+            state->move_to((int)round(state_cx - cx), (int)round(state_cy - cy));
+        }
+        else {
+            width  = (int)(max_x - min_x);
+            height = (int)(max_y - min_y);
+            cx = min_x;
+            cy = min_y;
+        }
 
-        cx = min_x;
-        cy = min_y;
+        // footprints are in canvas pixels and padded by the kernel support
+        const int margin = kernel_radius(kernel_type) + 2;
+        for (auto &f: footprints) {
+            f = Box({(int)floor(f.x0 - cx) - margin, (int)floor(f.y0 - cy) - margin,
+                     (int)ceil (f.x1 - cx) + margin, (int)ceil (f.y1 - cy) + margin}).intersect({0, 0, width, height});
+        }
 
         logger.info("min_x, max_x, min_y, max_y = %d, %d, %d, %d", min_x, max_x, min_y, max_y);
         logger.info("width=%d height=%d cx=%d cy=%d", width, height, cx, cy);
@@ -233,8 +1138,8 @@ struct astralcat::Stacker::Impl {
 
 namespace astralcat {
 
-    Stacker::Stacker() :
-        pimpl(new Stacker::Impl())
+    Stacker::Stacker(const char *stack_desc) :
+        pimpl(new Stacker::Impl(parse_keyvalue(stack_desc)))
     {
     }
 
@@ -246,4 +1151,12 @@ namespace astralcat {
         pimpl->stack(output_file);
     }
 
+    void Stacker::load_state(const char *state_file) {
+        pimpl->load_state(state_file);
+    }
+
+    void Stacker::save_state(const char *state_file) {
+        pimpl->save_state(state_file);
+    }
+
 }
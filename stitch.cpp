@@ -7,7 +7,11 @@ using namespace astralcat;
 
 int main(int argc, char *argv[]) {
     const char *output_file = NULL,
-               *ref_file = NULL;
+               *ref_file = NULL,
+               *stack_desc = "",
+               *kernel = NULL,
+               *resume_file = NULL,
+               *state_file = NULL;
 
     int fitting_order = 3;
 
@@ -16,9 +20,13 @@ int main(int argc, char *argv[]) {
         {"out",      required_argument, NULL, 'o'},
         {"order",    required_argument, NULL, 'n'},
         {"ref",      required_argument, NULL, 'r'},
+        {"stack",    required_argument, NULL, 's'},
+        {"kernel",   required_argument, NULL, 'k'},
+        {"resume",   required_argument, NULL, 'R'},
+        {"save-state", required_argument, NULL, 'S'},
         {NULL,       0,                 NULL, 0}
     };
-    while ((opt = getopt_long(argc, argv, "o:n:r:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "o:n:r:s:k:R:S:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'o':
                 output_file = optarg;
@@ -29,24 +37,44 @@ int main(int argc, char *argv[]) {
             case 'r':
                 ref_file = optarg;
                 break;
+            case 's':
+                stack_desc = optarg;
+                break;
+            case 'k':
+                kernel = optarg;
+                break;
+            case 'R':
+                resume_file = optarg;
+                break;
+            case 'S':
+                state_file = optarg;
+                break;
             default:
                 goto argument_error;
         }
     }
     if (output_file == NULL || optind == argc || (argc - optind) % 2 != 0) {
         argument_error:
-            fprintf(stderr, "usage: %s [-o OUT] [-r REF] [-n ORDER] CAT1 CAT2...CATN IMG1 IMG2...IMGN\n", argv[0]);
+            fprintf(stderr, "usage: %s [-o OUT] [-r REF] [-n ORDER] [--stack=STACK] [--kernel=KERNEL] [--resume=STATE] [--save-state=STATE] CAT1 CAT2...CATN IMG1 IMG2...IMGN\n", argv[0]);
             return 1;
     }
     int n_input = (argc - optind) / 2;
     char **cat_files = argv + optind,
          **img_files = argv + optind + n_input;
 
-    Stacker stacker;
+    std::string stack_args = stack_desc;
+    if (kernel)
+        stack_args += std::string(" kernel=") + kernel;
+    Stacker stacker(stack_args.c_str());
+
+    // the reference catalog of a saved stack lives next to it
+    std::string resume_ref = resume_file ? std::string(resume_file) + ".ref" : "";
+    if (resume_file)
+        stacker.load_state(resume_file);
 
     // mosaic
     Warper warper(fitting_order);
-    auto ref = load_sources(ref_file ? : cat_files[0]);
+    auto ref = load_sources(ref_file ? : resume_file ? resume_ref.c_str() : cat_files[0]);
     for (int i = 0;  i < n_input;  i++) {
         auto log_indent = logger.info("mosaicking %s...", cat_files[i]).indent();
         auto src = load_sources(cat_files[i]);
@@ -58,5 +86,10 @@ int main(int argc, char *argv[]) {
     // stack
     stacker.stack(output_file);
 
+    if (state_file) {
+        stacker.save_state(state_file);
+        save_sources((std::string(state_file) + ".ref").c_str(), ref);
+    }
+
     return 0;
 }